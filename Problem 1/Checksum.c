@@ -0,0 +1,196 @@
+/*
+ * Checksum.c
+ * Author: Christian Würthner
+ * Description: CRC32C checksums of copied data, computed while copying.
+ */
+
+#include "CopyEngine.h"
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+/* Reflected CRC32C (Castagnoli) polynomial */
+#define CRC32C_POLYNOMIAL 0x82F63B78
+
+/* Function updating a non-inverted CRC with the given data */
+typedef uint32_t (*crc32c_function_t)(uint32_t crc, const uint8_t *data, size_t length);
+
+/* Implementation chosen on first use */
+static crc32c_function_t crc32c_implementation = NULL;
+
+/* Table for the software implementation */
+static uint32_t crc32c_table[8][256];
+
+/* Software implementation processing 8 bytes per step (slicing-by-8) */
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length);
+
+#if defined(__x86_64__)
+/* Implementation using the crc32 instruction of SSE4.2 */
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length);
+#endif
+
+/* Chooses the fastest implementation for this CPU */
+static void crc32c_init();
+
+uint32_t crc32c(uint32_t crc, const void *data, size_t length) {
+	if(crc32c_implementation == NULL) {
+		crc32c_init();
+	}
+
+	return ~crc32c_implementation(~crc, data, length);
+}
+
+const char *crc32c_implementation_name() {
+	if(crc32c_implementation == NULL) {
+		crc32c_init();
+	}
+
+	return crc32c_implementation == crc32c_software ? "software" : "sse4.2";
+}
+
+int64_t copy_checksum(int src, int dest, uint32_t *checksum, copy_path_t *path) {
+	/* The data must pass user space to be checksummed */
+	*path = COPY_PATH_CHECKSUM;
+	*checksum = 0;
+
+	/* Use the buffer of this thread, it is too big for the stack */
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	/* Create counters */
+	uint64_t copied_count = 0;
+	ssize_t read_count = 0;
+
+	/* Copy blocks and checksum them while they are still in the cache */
+	while((read_count = read(src, buffer, COPY_BUFFER_SIZE)) != 0) {
+		/* Retry if interrupted, cancel on errors */
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		*checksum = crc32c(*checksum, buffer, read_count);
+
+		/* Write the whole block */
+		if(write_all(dest, buffer, read_count) < 0) {
+			read_count = -1;
+			break;
+		}
+
+		copied_count += read_count;
+		progress_add(read_count);
+	}
+
+	return read_count < 0 ? -1 : (int64_t) copied_count;
+}
+
+int64_t checksum_file(int fd, uint32_t *checksum) {
+	*checksum = 0;
+
+	/* Use the buffer of this thread */
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	/* Read the whole file from the beginning, independent of the current position */
+	uint64_t offset = 0;
+	ssize_t read_count = 0;
+	while((read_count = pread(fd, buffer, COPY_BUFFER_SIZE, offset)) != 0) {
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		*checksum = crc32c(*checksum, buffer, read_count);
+		offset += read_count;
+	}
+
+	return read_count < 0 ? -1 : (int64_t) offset;
+}
+
+static void crc32c_init() {
+	/* Fill the tables for the software implementation, table k processes a byte k positions
+	   before the end of an 8 byte word */
+	for(uint32_t i=0; i<256; i++) {
+		uint32_t crc = i;
+		for(uint8_t j=0; j<8; j++) {
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLYNOMIAL : crc >> 1;
+		}
+		crc32c_table[0][i] = crc;
+	}
+	for(uint32_t i=0; i<256; i++) {
+		for(uint8_t k=1; k<8; k++) {
+			crc32c_table[k][i] = (crc32c_table[k - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[k - 1][i] & 0xFF];
+		}
+	}
+
+	/* Use the crc32 instruction if the CPU has it */
+	crc32c_function_t implementation = crc32c_software;
+#if defined(__x86_64__)
+	if(__builtin_cpu_supports("sse4.2")) {
+		implementation = crc32c_sse42;
+	}
+#endif
+
+	/* Threads may race here, all of them store the same pointer */
+	__atomic_store_n(&crc32c_implementation, implementation, __ATOMIC_RELEASE);
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length) {
+	/* Process 8 bytes at once */
+	while(length >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		word ^= crc;
+		crc = crc32c_table[7][word & 0xFF] ^ crc32c_table[6][(word >> 8) & 0xFF] ^
+			crc32c_table[5][(word >> 16) & 0xFF] ^ crc32c_table[4][(word >> 24) & 0xFF] ^
+			crc32c_table[3][(word >> 32) & 0xFF] ^ crc32c_table[2][(word >> 40) & 0xFF] ^
+			crc32c_table[1][(word >> 48) & 0xFF] ^ crc32c_table[0][word >> 56];
+		data += 8;
+		length -= 8;
+	}
+
+	/* Process the remaining bytes one by one */
+	while(length > 0) {
+		crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *data) & 0xFF];
+		data++;
+		length--;
+	}
+
+	return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+	uint64_t crc64 = crc;
+
+	/* Process 8 bytes per instruction */
+	while(length >= 8) {
+		uint64_t word;
+		memcpy(&word, data, 8);
+		crc64 = _mm_crc32_u64(crc64, word);
+		data += 8;
+		length -= 8;
+	}
+
+	/* Process the remaining bytes one by one */
+	crc = crc64;
+	while(length > 0) {
+		crc = _mm_crc32_u8(crc, *data);
+		data++;
+		length--;
+	}
+
+	return crc;
+}
+#endif
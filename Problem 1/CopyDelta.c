@@ -0,0 +1,223 @@
+/*
+ * CopyDelta.c
+ * Author: Christian Würthner
+ * Description: Copy engine path only rewriting the blocks of an existing destination that differ.
+ */
+
+#include "CopyEngine.h"
+
+/* Structure shared by all workers of one delta copy */
+typedef struct {
+	int src;
+	int dest;
+	uint64_t size;
+	uint64_t dest_size;
+	uint64_t next_chunk;
+	int error;
+	delta_stats_t *stats;
+} delta_copy_t;
+
+/* Worker taking the next free chunk until all chunks are compared */
+static void *delta_worker(void *args_v);
+
+/* Compares and updates the blocks of one chunk, returns 0 or an errno */
+static int delta_chunk(delta_copy_t *copy, uint8_t *src_buffer, uint8_t *dest_buffer, uint64_t offset, uint64_t length);
+
+/* Reads exactly length bytes at offset or less at the end of the file, returns the count or -1 */
+static ssize_t pread_all(int fd, uint8_t *buffer, size_t length, uint64_t offset);
+
+int64_t copy_delta(int src, int dest, uint32_t thread_count, delta_stats_t *stats, copy_path_t *path) {
+	memset(stats, 0, sizeof(delta_stats_t));
+
+	/* Only two regular files can be compared, everything else is copied completely */
+	struct stat src_stat, dest_stat;
+	if(fstat(src, &src_stat) != 0 || fstat(dest, &dest_stat) != 0) {
+		return -1;
+	}
+	if(!S_ISREG(src_stat.st_mode) || !S_ISREG(dest_stat.st_mode) || src_stat.st_size == 0) {
+		if(S_ISREG(dest_stat.st_mode) && ftruncate(dest, 0) != 0) {
+			return -1;
+		}
+		return copy_kernel(src, dest, path);
+	}
+	*path = COPY_PATH_DELTA;
+
+	/* Create the shared state */
+	delta_copy_t copy;
+	copy.src = src;
+	copy.dest = dest;
+	copy.size = src_stat.st_size;
+	copy.dest_size = dest_stat.st_size;
+	copy.next_chunk = 0;
+	copy.error = 0;
+	copy.stats = stats;
+
+	/* Don't start more threads than there are chunks */
+	uint64_t chunk_count = (copy.size + COPY_DELTA_CHUNK_SIZE - 1) / COPY_DELTA_CHUNK_SIZE;
+	if(thread_count == 0) {
+		thread_count = COPY_PARALLEL_THREADS;
+	}
+	if(thread_count > chunk_count) {
+		thread_count = chunk_count;
+	}
+
+	/* Start all workers, the current thread only waits */
+	pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+	if(threads == NULL) {
+		return -1;
+	}
+	uint32_t started = 0;
+	for(; started<thread_count; started++) {
+		if(pthread_create(threads + started, NULL, delta_worker, (void*) &copy) != 0) {
+			__atomic_store_n(&copy.error, EAGAIN, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	/* Wait for all workers to finish */
+	for(uint32_t i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	/* Report the first error of any worker */
+	if(copy.error != 0) {
+		errno = copy.error;
+		return -1;
+	}
+
+	/* Cut off or extend the destination to the new size and make it durable */
+	if(ftruncate(dest, copy.size) != 0 || fsync(dest) != 0) {
+		return -1;
+	}
+
+	return copy.size;
+}
+
+static void *delta_worker(void *args_v) {
+	delta_copy_t *copy = (delta_copy_t*) args_v;
+
+	/* Create private buffers for one chunk of each file */
+	uint8_t *src_buffer = malloc(COPY_DELTA_CHUNK_SIZE);
+	uint8_t *dest_buffer = malloc(COPY_DELTA_CHUNK_SIZE);
+	if(src_buffer == NULL || dest_buffer == NULL) {
+		__atomic_store_n(&copy->error, ENOMEM, __ATOMIC_RELAXED);
+		free(src_buffer);
+		free(dest_buffer);
+		return NULL;
+	}
+
+	/* Take chunks until all are compared or any worker failed */
+	while(__atomic_load_n(&copy->error, __ATOMIC_RELAXED) == 0) {
+		/* Claim the next chunk */
+		uint64_t offset = __atomic_fetch_add(&copy->next_chunk, 1, __ATOMIC_RELAXED) * COPY_DELTA_CHUNK_SIZE;
+		if(offset >= copy->size) {
+			break;
+		}
+
+		/* The last chunk may be shorter */
+		uint64_t length = copy->size - offset;
+		if(length > COPY_DELTA_CHUNK_SIZE) {
+			length = COPY_DELTA_CHUNK_SIZE;
+		}
+
+		/* Compare the chunk and save the error */
+		int error = delta_chunk(copy, src_buffer, dest_buffer, offset, length);
+		if(error != 0) {
+			__atomic_store_n(&copy->error, error, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	/* Free buffers */
+	free(src_buffer);
+	free(dest_buffer);
+
+	return NULL;
+}
+
+static int delta_chunk(delta_copy_t *copy, uint8_t *src_buffer, uint8_t *dest_buffer, uint64_t offset, uint64_t length) {
+	/* Read the chunk of the source */
+	ssize_t src_count = pread_all(copy->src, src_buffer, length, offset);
+	if(src_count < 0) {
+		return errno;
+	}
+	if((uint64_t) src_count != length) {
+		return EIO;
+	}
+
+	/* Read the same chunk of the destination, it may be shorter or not exist at all */
+	ssize_t dest_count = 0;
+	if(offset < copy->dest_size) {
+		dest_count = pread_all(copy->dest, dest_buffer, length, offset);
+		if(dest_count < 0) {
+			return errno;
+		}
+	}
+
+	/* Compare block by block, the blocks are compared directly instead of hashing both sides
+	   because both files are local. Neighbouring changed blocks are written at once. */
+	uint64_t changed_count = 0, block_count = 0, written_count = 0;
+	for(uint64_t start=0; start<length; ) {
+		/* Find the end of the run of equal or changed blocks */
+		bool changed = false;
+		uint64_t end = start;
+		while(end < length) {
+			uint64_t block = length - end < COPY_DELTA_BLOCK_SIZE ? length - end : COPY_DELTA_BLOCK_SIZE;
+			bool block_changed = end + block > (uint64_t) dest_count || memcmp(src_buffer + end, dest_buffer + end, block) != 0;
+			if(end == start) {
+				changed = block_changed;
+			} else if(block_changed != changed) {
+				break;
+			}
+
+			end += block;
+			block_count++;
+			changed_count += block_changed;
+		}
+
+		/* Write changed runs */
+		for(uint64_t written=start; changed && written<end; ) {
+			ssize_t count = pwrite(copy->dest, src_buffer + written, end - written, offset + written);
+			if(count < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				return errno;
+			}
+			written += count;
+			written_count += count;
+		}
+
+		start = end;
+	}
+
+	/* Count the chunk */
+	__atomic_add_fetch(&copy->stats->block_count, block_count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&copy->stats->changed_count, changed_count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&copy->stats->written_count, written_count, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&copy->stats->compared_count, length, __ATOMIC_RELAXED);
+	progress_add(length);
+
+	return 0;
+}
+
+static ssize_t pread_all(int fd, uint8_t *buffer, size_t length, uint64_t offset) {
+	size_t done = 0;
+
+	while(done < length) {
+		ssize_t count = pread(fd, buffer + done, length - done, offset + done);
+		if(count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if(count == 0) {
+			break;
+		}
+		done += count;
+	}
+
+	return done;
+}
@@ -0,0 +1,168 @@
+/*
+ * CopyDirect.c
+ * Author: Christian Würthner
+ * Description: Copy engine path bypassing the page cache with O_DIRECT.
+ */
+
+#include "CopyEngine.h"
+
+/* Structure shared by the reader thread and the writing thread */
+typedef struct {
+	int src;
+	int dest;
+	uint8_t *buffers[COPY_DIRECT_BUFFER_COUNT];
+	size_t lengths[COPY_DIRECT_BUFFER_COUNT];
+	sem_t free;
+	sem_t filled;
+	int error;
+} direct_copy_t;
+
+/* Reader filling the free buffers of the pool in order */
+static void *direct_reader(void *args_v);
+
+/* Enables or disables O_DIRECT on the file descriptor, returns 0 or -1 */
+static int set_direct(int fd, bool enabled);
+
+int64_t copy_direct(int src, int dest, copy_path_t *path) {
+	/* Only regular files on filesystems supporting O_DIRECT can bypass the cache */
+	struct stat src_stat;
+	if(fstat(src, &src_stat) != 0) {
+		return -1;
+	}
+	if(!S_ISREG(src_stat.st_mode) || set_direct(src, true) != 0 || set_direct(dest, true) != 0) {
+		/* The normal engine needs both files in normal mode */
+		set_direct(src, false);
+		return copy_kernel(src, dest, path);
+	}
+	*path = COPY_PATH_DIRECT;
+
+	/* Create the pool of aligned buffers */
+	direct_copy_t copy;
+	memset(&copy, 0, sizeof(direct_copy_t));
+	copy.src = src;
+	copy.dest = dest;
+	for(uint8_t i=0; i<COPY_DIRECT_BUFFER_COUNT; i++) {
+		if(posix_memalign((void**) (copy.buffers + i), COPY_DIRECT_ALIGNMENT, COPY_DIRECT_BLOCK_SIZE) != 0) {
+			for(uint8_t j=0; j<i; j++) {
+				free(copy.buffers[j]);
+			}
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+
+	/* All buffers are free in the beginning */
+	sem_init(&copy.free, 0, COPY_DIRECT_BUFFER_COUNT);
+	sem_init(&copy.filled, 0, 0);
+
+	/* Start the reader, the current thread writes */
+	pthread_t reader;
+	bool reader_started = pthread_create(&reader, NULL, direct_reader, (void*) &copy) == 0;
+	if(!reader_started) {
+		copy.error = EAGAIN;
+	}
+
+	/* Write the buffers in the order they were filled until the reader reports the end */
+	uint64_t copied_count = 0;
+	for(uint64_t i=0; copy.error == 0; i++) {
+		/* Wait for the next buffer */
+		sem_wait(&copy.filled);
+		uint8_t slot = i % COPY_DIRECT_BUFFER_COUNT;
+		size_t length = copy.lengths[slot];
+		if(length == 0 || __atomic_load_n(&copy.error, __ATOMIC_ACQUIRE) != 0) {
+			break;
+		}
+
+		/* The unaligned tail is padded with zeros to the next aligned size, the destination
+		   is truncated to its real size after all buffers are written */
+		size_t aligned = (length + COPY_DIRECT_ALIGNMENT - 1) / COPY_DIRECT_ALIGNMENT * COPY_DIRECT_ALIGNMENT;
+		memset(copy.buffers[slot] + length, 0, aligned - length);
+
+		/* Write the buffer and give it back to the reader */
+		if(write_all(dest, copy.buffers[slot], aligned) != 0) {
+			__atomic_store_n(&copy.error, errno, __ATOMIC_RELEASE);
+			sem_post(&copy.free);
+			break;
+		}
+		sem_post(&copy.free);
+
+		copied_count += length;
+		progress_add(length);
+	}
+
+	/* Wait for the reader and free the pool */
+	if(reader_started) {
+		pthread_join(reader, NULL);
+	}
+	for(uint8_t i=0; i<COPY_DIRECT_BUFFER_COUNT; i++) {
+		free(copy.buffers[i]);
+	}
+	sem_destroy(&copy.free);
+	sem_destroy(&copy.filled);
+
+	/* Report errors of both threads */
+	if(copy.error != 0) {
+		errno = copy.error;
+		return -1;
+	}
+
+	/* Cut off the padding of the tail */
+	if(ftruncate(dest, copied_count) != 0) {
+		return -1;
+	}
+
+	return copied_count;
+}
+
+static void *direct_reader(void *args_v) {
+	direct_copy_t *copy = (direct_copy_t*) args_v;
+
+	for(uint64_t i=0; ; i++) {
+		/* Wait for a free buffer and stop if the writer failed */
+		sem_wait(&copy->free);
+		if(__atomic_load_n(&copy->error, __ATOMIC_ACQUIRE) != 0) {
+			break;
+		}
+
+		/* Fill the buffer, only the last read of the file returns less than requested */
+		uint8_t slot = i % COPY_DIRECT_BUFFER_COUNT;
+		size_t length = 0;
+		while(length < COPY_DIRECT_BLOCK_SIZE) {
+			ssize_t read_count = read(copy->src, copy->buffers[slot] + length, COPY_DIRECT_BLOCK_SIZE - length);
+			if(read_count < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				__atomic_store_n(&copy->error, errno, __ATOMIC_RELEASE);
+				break;
+			}
+			if(read_count == 0) {
+				break;
+			}
+			length += read_count;
+
+			/* A partly filled block must be the end of the file, the next aligned read
+			   would start at an unaligned offset */
+			if(length % COPY_DIRECT_ALIGNMENT != 0) {
+				break;
+			}
+		}
+
+		/* Hand the buffer to the writer, an empty one marks the end */
+		copy->lengths[slot] = length;
+		sem_post(&copy->filled);
+		if(length == 0 || copy->error != 0) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+static int set_direct(int fd, bool enabled) {
+	int flags = fcntl(fd, F_GETFL);
+	if(flags < 0) {
+		return -1;
+	}
+	return fcntl(fd, F_SETFL, enabled ? flags | O_DIRECT : flags & ~O_DIRECT);
+}
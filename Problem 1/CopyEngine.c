@@ -0,0 +1,200 @@
+/*
+ * CopyEngine.c
+ * Author: Christian Würthner
+ * Description: Copy engine shared by the copy programs.
+ */
+
+#include "CopyEngine.h"
+
+/* Key of the buffer of each thread */
+static pthread_key_t copy_buffer_key;
+static pthread_once_t copy_buffer_once = PTHREAD_ONCE_INIT;
+
+/* Creates the key, the buffers are freed when their thread exits */
+static void copy_buffer_init();
+
+int64_t copy_kernel(int src, int dest, copy_path_t *path) {
+	/* Create counters */
+	uint64_t copied_count = 0;
+	ssize_t done = 0;
+
+	/* Try copy_file_range() first, the data never leaves the kernel and the filesystem
+	   may even share the extents */
+	*path = COPY_PATH_COPY_FILE_RANGE;
+	while((done = copy_file_range(src, NULL, dest, NULL, COPY_CHUNK_SIZE, 0)) > 0) {
+		copied_count += done;
+		progress_add(done);
+	}
+
+	/* Done if copy_file_range() reached the end of the file */
+	if(done == 0 && copied_count > 0) {
+		return copied_count;
+	}
+
+	/* Cancel on real errors, only unsupported file combinations fall back */
+	if(done < 0 && !is_fallback_error(errno)) {
+		return -1;
+	}
+
+	/* Try sendfile(), the data is still copied in the kernel but through the page cache.
+	   The file offsets are updated by both calls, so we can continue where we stopped. */
+	*path = COPY_PATH_SENDFILE;
+	while((done = sendfile(dest, src, NULL, COPY_CHUNK_SIZE)) > 0) {
+		copied_count += done;
+		progress_add(done);
+	}
+
+	/* Done if sendfile() reached the end of the file */
+	if(done == 0 && copied_count > 0) {
+		return copied_count;
+	}
+
+	/* Cancel on real errors */
+	if(done < 0 && !is_fallback_error(errno)) {
+		return -1;
+	}
+
+	/* Use the read/write loop as last resort */
+	*path = COPY_PATH_READ_WRITE;
+	int64_t result = copy_read_write(src, dest);
+	if(result < 0) {
+		return -1;
+	}
+
+	return copied_count + result;
+}
+
+int64_t copy_read_write(int src, int dest) {
+	return copy_read_write_range(src, dest, UINT64_MAX);
+}
+
+int64_t copy_read_write_range(int src, int dest, uint64_t count) {
+	/* Use the buffer of this thread, it is too big for the stack */
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	/* Create counters */
+	uint64_t copied_count = 0;
+	ssize_t read_count = 0;
+
+	/* Copy blocks */
+	while(copied_count < count && (read_count = read(src, buffer, count - copied_count < COPY_BUFFER_SIZE ? count - copied_count : COPY_BUFFER_SIZE)) != 0) {
+		/* Retry if interrupted, cancel on errors */
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		/* Write the whole block */
+		if(write_all(dest, buffer, read_count) < 0) {
+			read_count = -1;
+			break;
+		}
+
+		copied_count += read_count;
+		progress_add(read_count);
+	}
+
+	return read_count < 0 ? -1 : (int64_t) copied_count;
+}
+
+uint8_t *copy_buffer() {
+	pthread_once(&copy_buffer_once, copy_buffer_init);
+
+	/* Allocate the buffer on the first use in this thread */
+	uint8_t *buffer = pthread_getspecific(copy_buffer_key);
+	if(buffer == NULL) {
+		buffer = malloc(COPY_BUFFER_SIZE);
+		if(buffer == NULL || pthread_setspecific(copy_buffer_key, buffer) != 0) {
+			free(buffer);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	return buffer;
+}
+
+int write_all(int fd, const uint8_t *buffer, size_t count) {
+	/* Write until all bytes are written, write() may return early */
+	while(count > 0) {
+		ssize_t written = write(fd, buffer, count);
+		if(written < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		buffer += written;
+		count -= written;
+	}
+
+	return 0;
+}
+
+bool parse_size(const char *text, uint64_t *size) {
+	/* Parse the number */
+	char *end;
+	errno = 0;
+	uint64_t value = strtoull(text, &end, 10);
+	if(errno != 0 || end == text) {
+		return false;
+	}
+
+	/* Apply the unit, sizes that don't fit into 64 bits with it are invalid */
+	uint64_t multiplier = 1;
+	switch(*end) {
+		case 'G': case 'g': multiplier *= 1024;
+		/* fall through */
+		case 'M': case 'm': multiplier *= 1024;
+		/* fall through */
+		case 'K': case 'k': multiplier *= 1024;
+			end++;
+			break;
+	}
+	if(value > UINT64_MAX / multiplier) {
+		return false;
+	}
+	value *= multiplier;
+
+	/* Nothing may follow the unit */
+	if(*end != 0) {
+		return false;
+	}
+
+	*size = value;
+	return true;
+}
+
+const char *copy_path_name(copy_path_t path) {
+	switch(path) {
+		case COPY_PATH_COPY_FILE_RANGE: return "copy_file_range";
+		case COPY_PATH_SENDFILE: return "sendfile";
+		case COPY_PATH_READ_WRITE: return "read/write";
+		case COPY_PATH_MMAP: return "mmap";
+		case COPY_PATH_PREAD_PWRITE: return "pread/pwrite";
+		case COPY_PATH_IO_URING: return "io_uring";
+		case COPY_PATH_DIRECT: return "O_DIRECT";
+		case COPY_PATH_SPARSE: return "sparse";
+		case COPY_PATH_REFLINK: return "reflink";
+		case COPY_PATH_CHECKSUM: return "read/write+crc32c";
+		case COPY_PATH_DELTA: return "delta";
+		case COPY_PATH_THROTTLED: return "read/write (throttled)";
+		case COPY_PATH_SPLICE: return "splice";
+		default: return "none";
+	}
+}
+
+bool is_fallback_error(int error) {
+	/* Not supported by the kernel, the filesystem or this combination of files */
+	return error == ENOSYS || error == EXDEV || error == EINVAL || error == EOPNOTSUPP || error == EBADF || error == ENOTTY;
+}
+
+static void copy_buffer_init() {
+	pthread_key_create(&copy_buffer_key, free);
+}
@@ -0,0 +1,334 @@
+/*
+ * CopyEngine.h
+ * Author: Christian Würthner
+ * Description: Copy engine shared by the copy programs.
+ */
+
+#ifndef COPY_ENGINE_H
+#define COPY_ENGINE_H
+
+#define _GNU_SOURCE
+
+/* Size of the buffer used by the read/write fallback in bytes */
+#define COPY_BUFFER_SIZE (1024 * 1024) /* 1 MiB */
+
+/* Maximum number of bytes moved by one copy_file_range() or sendfile() call */
+#define COPY_CHUNK_SIZE (64 * 1024 * 1024) /* 64 MiB */
+
+/* Size of the sliding window mapped by the mmap copy in bytes, must be a multiple of the page size */
+#define COPY_MMAP_WINDOW_SIZE (64 * 1024 * 1024) /* 64 MiB */
+
+/* Default number of worker threads and size of the ranges they copy for the parallel copy */
+#define COPY_PARALLEL_THREADS 4
+#define COPY_PARALLEL_CHUNK_SIZE (8 * 1024 * 1024) /* 8 MiB */
+
+/* Default and maximum number of buffers in flight and their size for the io_uring copy */
+#define COPY_URING_QUEUE_DEPTH 32
+#define COPY_URING_MAX_QUEUE_DEPTH 4096
+#define COPY_URING_BLOCK_SIZE (256 * 1024) /* 256 KiB */
+
+/* Number of buffers in the pool of the O_DIRECT copy, their size and alignment */
+#define COPY_DIRECT_BUFFER_COUNT 4
+#define COPY_DIRECT_BLOCK_SIZE (4 * 1024 * 1024) /* 4 MiB */
+#define COPY_DIRECT_ALIGNMENT 4096
+
+/* Size of the pieces checked for zeros by the sparse copy */
+#define COPY_SPARSE_BLOCK_SIZE 4096
+
+/* Default number of workers and size of the work queue for the recursive copy. Entries are only
+   queued while at most COPY_TREE_OPEN_DIRS directories are open, each of them needs two
+   descriptors. */
+#define COPY_TREE_WORKERS 8
+#define COPY_TREE_QUEUE_SIZE 4096
+#define COPY_TREE_OPEN_DIRS 256
+
+/* Size of the blocks compared by the delta copy and of the ranges a worker compares at once */
+#define COPY_DELTA_BLOCK_SIZE (64 * 1024) /* 64 KiB */
+#define COPY_DELTA_CHUNK_SIZE (4 * 1024 * 1024) /* 4 MiB */
+
+/* Time between two progress reports in ms and maximum length of a shared memory name */
+#define PROGRESS_INTERVAL_MS 500
+#define PROGRESS_SHM_NAME_LENGTH 256
+
+/* Default size of the pipes of PipeCopy and maximum number of its stripes and stages */
+#define COPY_PIPE_SIZE (1024 * 1024) /* 1 MiB */
+#define COPY_MAX_STRIPES 64
+#define COPY_MAX_STAGES 8
+
+/* Number and size of the slots of the shared memory ring */
+#define COPY_RING_SLOT_COUNT 16
+#define COPY_RING_SLOT_SIZE (1024 * 1024) /* 1 MiB */
+
+/* Size of the blocks the transform stages compress, must not exceed COPY_BUFFER_SIZE */
+#define COPY_LZ_BLOCK_SIZE (256 * 1024) /* 256 KiB */
+
+/* Size of the blocks written by the throttled copy, the interval the buckets may burst, the
+   interval the control file is checked and the interval the adaptive rate is adjusted in ms */
+#define THROTTLE_BLOCK_SIZE (256 * 1024) /* 256 KiB */
+#define THROTTLE_BURST_MS 100
+#define THROTTLE_CONTROL_INTERVAL_MS 1000
+#define THROTTLE_ADAPT_INTERVAL_MS 100
+
+/* Latency over the idle latency that makes the adaptive throttle back off, and its lowest rate */
+#define THROTTLE_LATENCY_FACTOR 2.
+#define THROTTLE_MIN_RATE (64 * 1024) /* 64 KiB/s */
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <limits.h>
+
+/* Where the progress of a copy is reported */
+typedef enum {
+	PROGRESS_NONE,
+	PROGRESS_TTY,
+	PROGRESS_JSON,
+	PROGRESS_SHM
+} progress_mode_t;
+
+/* Layout of the shared memory object other tools can poll in PROGRESS_SHM mode */
+typedef struct {
+	uint64_t bytes;
+	uint64_t total;
+	double start_ms;
+	uint32_t pid;
+	uint32_t done;
+} progress_shm_t;
+
+/* Counter of copied bytes, all copy paths add to it */
+extern uint64_t *progress_counter;
+
+/* Counts copied bytes, this is the only thing the copy loops do for progress reports */
+static inline void progress_add(uint64_t count) {
+	__atomic_fetch_add(progress_counter, count, __ATOMIC_RELAXED);
+}
+
+/* Parses none, tty, json, shm or shm:/name, returns false if the text is invalid */
+bool progress_parse_mode(const char *text, progress_mode_t *mode, const char **shm_name);
+
+/* Starts reporting the progress towards total bytes (0 if unknown). tty and json are printed
+   every PROGRESS_INTERVAL_MS by a side thread, shm moves the counter to shared memory. */
+int progress_start(progress_mode_t mode, uint64_t total, const char *shm_name);
+
+/* Stops reporting and prints the final state */
+void progress_stop();
+
+/* Returns the bytes counted so far */
+uint64_t progress_bytes();
+
+/* Moves the counter to shared memory, so children forked afterwards count for the caller's
+   reports. Call it before progress_start(). Returns -1 on errors. */
+int progress_share();
+
+/* Lets a child count on its own again, for children whose bytes are counted by others */
+void progress_detach();
+
+/* The different ways the engine can move data from one file to the other */
+typedef enum {
+	COPY_PATH_NONE,
+	COPY_PATH_COPY_FILE_RANGE,
+	COPY_PATH_SENDFILE,
+	COPY_PATH_READ_WRITE,
+	COPY_PATH_MMAP,
+	COPY_PATH_PREAD_PWRITE,
+	COPY_PATH_IO_URING,
+	COPY_PATH_DIRECT,
+	COPY_PATH_SPARSE,
+	COPY_PATH_REFLINK,
+	COPY_PATH_CHECKSUM,
+	COPY_PATH_DELTA,
+	COPY_PATH_THROTTLED,
+	COPY_PATH_SPLICE
+} copy_path_t;
+
+/* Copies everything from src to dest, preferring copy_file_range(), then sendfile() and at last
+   a read/write loop. Returns the number of bytes copied or -1 and sets path to the path used. */
+int64_t copy_kernel(int src, int dest, copy_path_t *path);
+
+/* Copies src to dest by mapping both files in sliding windows. The destination is resized to the
+   size of the source. Falls back to copy_kernel() if src can't be mapped. */
+int64_t copy_mmap(int src, int dest, copy_path_t *path);
+
+/* Splits src into ranges of chunk_size bytes which are copied by thread_count threads with
+   pread()/pwrite(), followed by a fsync() of dest. Falls back to copy_kernel() if src is no
+   regular file. */
+int64_t copy_parallel(int src, int dest, uint32_t thread_count, uint64_t chunk_size, copy_path_t *path);
+
+/* Copies src to dest with io_uring keeping up to queue_depth buffers in flight. Between two files
+   every read is linked to its write, pipes and other streams are read and written in order.
+   Falls back to copy_kernel() if the kernel doesn't support io_uring. */
+int64_t copy_uring(int src, int dest, uint32_t queue_depth, copy_path_t *path);
+
+/* Copies src to dest with O_DIRECT, bypassing the page cache. A reader thread fills a pool of
+   aligned buffers which are written by the calling thread. Falls back to copy_kernel() if a file
+   doesn't support O_DIRECT. */
+int64_t copy_direct(int src, int dest, copy_path_t *path);
+
+/* Copies src to dest reading only the data extents of src (SEEK_DATA/SEEK_HOLE) and skipping
+   zero blocks, so holes are recreated in dest. Streams get the holes as zeros. */
+int64_t copy_sparse(int src, int dest, copy_path_t *path);
+
+/* Moves up to count pages of src to dest with splice(), directly if one of them is a pipe and
+   through a pipe of our own otherwise. Continues with a read/write loop if a file doesn't support
+   it. Pass UINT64_MAX as count to copy everything. */
+int64_t copy_splice(int src, int dest, uint64_t count, copy_path_t *path);
+
+/* Resizes the pipe to size bytes with F_SETPIPE_SZ, or to /proc/sys/fs/pipe-max-size for 0 or
+   anything larger. Returns the new size or -1. */
+int pipe_set_size(int fd, uint64_t size);
+
+/* Ring buffer in shared memory between one producer and one consumer process */
+typedef struct copy_ring copy_ring_t;
+
+/* Maps a ring with slot_count slots of slot_size bytes, call it before fork(). Returns NULL on errors. */
+copy_ring_t *ring_create(uint32_t slot_count, uint32_t slot_size);
+
+/* Unmaps the ring */
+void ring_destroy(copy_ring_t *ring);
+
+/* Reads src into the ring until the end of the file. The indices are atomic, a futex is only
+   used when the ring is full. Returns the bytes read or -1, an error aborts the consumer. */
+int64_t ring_produce(copy_ring_t *ring, int src);
+
+/* Writes the slots of the ring to dest until the producer is done, sleeping on a futex only when
+   the ring is empty. Returns the bytes written or -1, an error aborts the producer. */
+int64_t ring_consume(copy_ring_t *ring, int dest);
+
+/* Marks the ring as aborted and wakes both sides, they fail with EPIPE */
+void ring_abort(copy_ring_t *ring);
+
+/* Returns how often each side had to sleep */
+void ring_waits(copy_ring_t *ring, uint64_t *producer_waits, uint64_t *consumer_waits);
+
+/* Transforms a stage of PipeCopy can apply to the stream */
+typedef enum {
+	TRANSFORM_NONE,
+	TRANSFORM_CRC32C,
+	TRANSFORM_COUNT,
+	TRANSFORM_COMPRESS,
+	TRANSFORM_DECOMPRESS
+} transform_t;
+
+/* What a transform saw, the checksum is only set by TRANSFORM_CRC32C */
+typedef struct {
+	uint64_t in_count;
+	uint64_t out_count;
+	uint32_t checksum;
+} transform_result_t;
+
+/* Parses crc32c, count, compress or decompress, returns false if the text is invalid */
+bool transform_parse(const char *text, transform_t *transform);
+
+/* Returns a printable name for the given transform */
+const char *transform_name(transform_t transform);
+
+/* Copies src to dest applying the transform. crc32c and count pass the data through, compress
+   writes blocks of COPY_LZ_BLOCK_SIZE with a small LZ77 coder and decompress reverses it.
+   Returns the bytes written or -1, corrupted compressed data fails with EILSEQ. */
+int64_t transform_stream(int src, int dest, transform_t transform, transform_result_t *result);
+
+/* Lets dest share all extents of src with FICLONE (btrfs, XFS). No data is copied. Returns the
+   size of src or -1, is_fallback_error() tells if the filesystem doesn't support it. */
+int64_t copy_reflink(int src, int dest, copy_path_t *path);
+
+/* Function copying one opened file, used by the recursive copy for every file. The name is the
+   path of the destination, for messages. */
+typedef int64_t (*copy_function_t)(int src, int dest, const char *name, void *context, copy_path_t *path);
+
+/* Results of a recursive copy */
+typedef struct {
+	uint64_t file_count;
+	uint64_t copied_count;
+	uint64_t error_count;
+} tree_stats_t;
+
+/* Copies the directory src recursively to dest. The directories are scanned with getdents64()
+   and openat() by worker_count workers sharing a bounded queue, every file is copied with copy.
+   Existing destination files are truncated unless truncate is false (copies updating them in place).
+   Returns -1 if the root directories can't be opened, errors of entries are counted in stats. */
+int copy_tree(const char *src, const char *dest, uint32_t worker_count, bool truncate, copy_function_t copy, void *context, tree_stats_t *stats);
+
+/* Copies everything from src to dest with a read/write loop and computes the CRC32C of the data */
+int64_t copy_checksum(int src, int dest, uint32_t *checksum, copy_path_t *path);
+
+/* Computes the CRC32C of the whole file, returns the size of the file or -1 */
+int64_t checksum_file(int fd, uint32_t *checksum);
+
+/* Continues the CRC32C crc (0 for the first block) with the given data, using SSE4.2 if possible */
+uint32_t crc32c(uint32_t crc, const void *data, size_t length);
+
+/* Returns the name of the CRC32C implementation used on this CPU */
+const char *crc32c_implementation_name();
+
+/* Results of a delta copy */
+typedef struct {
+	uint64_t compared_count;
+	uint64_t written_count;
+	uint64_t block_count;
+	uint64_t changed_count;
+} delta_stats_t;
+
+/* Updates an existing dest to the content of src. thread_count threads compare the blocks of
+   both files and only rewrite the blocks that differ, then dest is resized to the size of src.
+   Copies everything with copy_kernel() if one of the files is no regular file. */
+int64_t copy_delta(int src, int dest, uint32_t thread_count, delta_stats_t *stats, copy_path_t *path);
+
+/* Limits of the throttle, 0 is unlimited */
+typedef struct {
+	uint64_t byte_rate;
+	uint64_t op_rate;
+	bool adaptive;
+	const char *control_file;
+} throttle_options_t;
+
+/* Checks if any limit, the adaptive mode or a control file was requested */
+bool throttle_requested(const throttle_options_t *options);
+
+/* Starts limiting write_throttled() to the given rates with token buckets. The control file holds
+   words like "bytes=10M ops=500 adaptive=on" and is reloaded when it changes or on SIGHUP,
+   SIGUSR1 halves and SIGUSR2 doubles the limits. The adaptive mode backs off while the write
+   latency rises over the idle latency. Returns -1 if the control file can't be read. */
+int throttle_start(const throttle_options_t *options);
+
+/* Writes count bytes from buffer to fd after waiting for the tokens, like write_all() if the
+   throttle wasn't started */
+int write_throttled(int fd, const uint8_t *buffer, size_t count);
+
+/* Copies everything from src to dest with a read/write loop limited by the throttle */
+int64_t copy_throttled(int src, int dest, copy_path_t *path);
+
+/* Copies everything from src to dest with a large buffer read/write loop */
+int64_t copy_read_write(int src, int dest);
+
+/* Copies up to count bytes from src to dest with a large buffer read/write loop */
+int64_t copy_read_write_range(int src, int dest, uint64_t count);
+
+/* Returns the COPY_BUFFER_SIZE buffer of the calling thread, it is reused by all copies of the
+   thread and freed when the thread exits. Returns NULL if it can't be allocated. */
+uint8_t *copy_buffer();
+
+/* Writes count bytes from buffer to fd, retrying on short writes. Returns 0 or -1 on error. */
+int write_all(int fd, const uint8_t *buffer, size_t count);
+
+/* Parses a size like 512, 64K, 8M or 1G into bytes, returns false if it is invalid */
+bool parse_size(const char *text, uint64_t *size);
+
+/* Checks if the error reported by a copy path means that the file combination isn't supported
+   by it and the next path should be tried */
+bool is_fallback_error(int error);
+
+/* Returns a printable name for the given path */
+const char *copy_path_name(copy_path_t path);
+
+#endif
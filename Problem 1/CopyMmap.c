@@ -0,0 +1,66 @@
+/*
+ * CopyMmap.c
+ * Author: Christian Würthner
+ * Description: Copy engine path copying with memory mapped windows.
+ */
+
+#include "CopyEngine.h"
+
+int64_t copy_mmap(int src, int dest, copy_path_t *path) {
+	/* Only regular files with a known size can be mapped, use the normal engine for everything
+	   else (pipes, devices, files in /proc). The destination is resized, so it must be regular
+	   as well. */
+	struct stat src_stat, dest_stat;
+	if(fstat(src, &src_stat) != 0 || fstat(dest, &dest_stat) != 0) {
+		return -1;
+	}
+	if(!S_ISREG(src_stat.st_mode) || src_stat.st_size == 0 || !S_ISREG(dest_stat.st_mode)) {
+		return copy_kernel(src, dest, path);
+	}
+
+	/* Pre-size the destination so its pages can be mapped */
+	*path = COPY_PATH_MMAP;
+	uint64_t size = src_stat.st_size;
+	if(ftruncate(dest, size) != 0) {
+		return -1;
+	}
+
+	/* Copy window by window, so only one window of each file is mapped at a time */
+	uint64_t copied_count = 0;
+	while(copied_count < size) {
+		/* Calculate the length of the current window, the last one may be shorter */
+		size_t length = size - copied_count;
+		if(length > COPY_MMAP_WINDOW_SIZE) {
+			length = COPY_MMAP_WINDOW_SIZE;
+		}
+
+		/* Map the window of the source and tell the kernel to read ahead aggressively */
+		uint8_t *src_map = mmap(NULL, length, PROT_READ, MAP_SHARED, src, copied_count);
+		if(src_map == MAP_FAILED) {
+			return -1;
+		}
+		madvise(src_map, length, MADV_SEQUENTIAL);
+
+		/* Map the same window of the destination */
+		uint8_t *dest_map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, dest, copied_count);
+		if(dest_map == MAP_FAILED) {
+			munmap(src_map, length);
+			return -1;
+		}
+		madvise(dest_map, length, MADV_SEQUENTIAL);
+
+		/* Copy the window, the page faults pull in the source pages */
+		memcpy(dest_map, src_map, length);
+
+		/* Drop the pages of the window from our address space so the RSS stays bounded */
+		madvise(src_map, length, MADV_DONTNEED);
+		madvise(dest_map, length, MADV_DONTNEED);
+		munmap(src_map, length);
+		munmap(dest_map, length);
+
+		copied_count += length;
+		progress_add(length);
+	}
+
+	return copied_count;
+}
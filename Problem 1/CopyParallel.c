@@ -0,0 +1,175 @@
+/*
+ * CopyParallel.c
+ * Author: Christian Würthner
+ * Description: Copy engine path copying ranges of a file with multiple threads.
+ */
+
+#include "CopyEngine.h"
+
+/* Structure shared by all workers of one parallel copy */
+typedef struct {
+	int src;
+	int dest;
+	uint64_t size;
+	uint64_t chunk_size;
+	uint64_t next_chunk;
+	uint64_t copied_count;
+	int error;
+} parallel_copy_t;
+
+/* Worker taking the next free chunk until all chunks are copied */
+static void *copy_worker(void *args_v);
+
+/* Copies the range [offset, offset + length) with pread()/pwrite(), returns 0 or an errno */
+static int copy_range(parallel_copy_t *copy, uint8_t *buffer, size_t buffer_size, uint64_t offset, uint64_t length);
+
+int64_t copy_parallel(int src, int dest, uint32_t thread_count, uint64_t chunk_size, copy_path_t *path) {
+	/* Only regular files with a known size can be split, use the normal engine for everything else */
+	struct stat src_stat;
+	if(fstat(src, &src_stat) != 0) {
+		return -1;
+	}
+	if(!S_ISREG(src_stat.st_mode) || src_stat.st_size == 0) {
+		return copy_kernel(src, dest, path);
+	}
+
+	/* Pre-size the destination so the workers can write at any offset */
+	*path = COPY_PATH_PREAD_PWRITE;
+	if(ftruncate(dest, src_stat.st_size) != 0) {
+		return -1;
+	}
+
+	/* Create the shared state */
+	parallel_copy_t copy;
+	copy.src = src;
+	copy.dest = dest;
+	copy.size = src_stat.st_size;
+	copy.chunk_size = chunk_size > 0 ? chunk_size : COPY_PARALLEL_CHUNK_SIZE;
+	if(copy.chunk_size > copy.size) {
+		copy.chunk_size = copy.size;
+	}
+	copy.next_chunk = 0;
+	copy.copied_count = 0;
+	copy.error = 0;
+
+	/* Don't start more threads than there are chunks */
+	uint64_t chunk_count = copy.size / copy.chunk_size + (copy.size % copy.chunk_size != 0);
+	if(thread_count == 0) {
+		thread_count = COPY_PARALLEL_THREADS;
+	}
+	if(thread_count > chunk_count) {
+		thread_count = chunk_count;
+	}
+
+	/* Start all workers, the current thread only waits */
+	pthread_t *threads = malloc(sizeof(pthread_t) * thread_count);
+	if(threads == NULL) {
+		return -1;
+	}
+	uint32_t started = 0;
+	for(; started<thread_count; started++) {
+		if(pthread_create(threads + started, NULL, copy_worker, (void*) &copy) != 0) {
+			__atomic_store_n(&copy.error, EAGAIN, __ATOMIC_RELAXED);
+			break;
+		}
+	}
+
+	/* Wait for all workers to finish */
+	for(uint32_t i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	/* Report the first error of any worker */
+	if(copy.error != 0) {
+		errno = copy.error;
+		return -1;
+	}
+
+	/* Barrier: the copy is only done when all ranges reached the disk */
+	if(fsync(dest) != 0) {
+		return -1;
+	}
+
+	return copy.copied_count;
+}
+
+static void *copy_worker(void *args_v) {
+	parallel_copy_t *copy = (parallel_copy_t*) args_v;
+
+	/* Create a private buffer, one chunk or less */
+	size_t buffer_size = copy->chunk_size < COPY_BUFFER_SIZE ? copy->chunk_size : COPY_BUFFER_SIZE;
+	uint8_t *buffer = malloc(buffer_size);
+	if(buffer == NULL) {
+		__atomic_store_n(&copy->error, ENOMEM, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	/* Take chunks until all are copied or any worker failed */
+	while(__atomic_load_n(&copy->error, __ATOMIC_RELAXED) == 0) {
+		/* Claim the next chunk */
+		uint64_t offset = __atomic_fetch_add(&copy->next_chunk, 1, __ATOMIC_RELAXED) * copy->chunk_size;
+		if(offset >= copy->size) {
+			break;
+		}
+
+		/* The last chunk may be shorter */
+		uint64_t length = copy->size - offset;
+		if(length > copy->chunk_size) {
+			length = copy->chunk_size;
+		}
+
+		/* Copy the chunk and save the error */
+		int error = copy_range(copy, buffer, buffer_size, offset, length);
+		if(error != 0) {
+			__atomic_store_n(&copy->error, error, __ATOMIC_RELAXED);
+			break;
+		}
+
+		/* Count the bytes, the counter is shared by all workers */
+		__atomic_add_fetch(&copy->copied_count, length, __ATOMIC_RELAXED);
+		progress_add(length);
+	}
+
+	/* Free buffer */
+	free(buffer);
+
+	return NULL;
+}
+
+static int copy_range(parallel_copy_t *copy, uint8_t *buffer, size_t buffer_size, uint64_t offset, uint64_t length) {
+	uint64_t end = offset + length;
+
+	while(offset < end) {
+		/* Read the next block of the range */
+		size_t count = end - offset < buffer_size ? end - offset : buffer_size;
+		ssize_t read_count = pread(copy->src, buffer, count, offset);
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return errno;
+		}
+
+		/* The source got shorter while copying */
+		if(read_count == 0) {
+			return EIO;
+		}
+
+		/* Write the block at the same offset, retry on short writes */
+		for(ssize_t written_count=0; written_count<read_count; ) {
+			ssize_t written = pwrite(copy->dest, buffer + written_count, read_count - written_count, offset + written_count);
+			if(written < 0) {
+				if(errno == EINTR) {
+					continue;
+				}
+				return errno;
+			}
+			written_count += written;
+		}
+
+		offset += read_count;
+	}
+
+	return 0;
+}
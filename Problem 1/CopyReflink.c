@@ -0,0 +1,27 @@
+/*
+ * CopyReflink.c
+ * Author: Christian Würthner
+ * Description: Copy engine path sharing the extents of the source (copy-on-write).
+ */
+
+#include "CopyEngine.h"
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+int64_t copy_reflink(int src, int dest, copy_path_t *path) {
+	/* The size is needed for the result */
+	struct stat src_stat;
+	if(fstat(src, &src_stat) != 0) {
+		return -1;
+	}
+
+	/* Clone the whole file, the filesystem only copies metadata. Unaligned file ends are
+	   handled by the filesystem, so no FICLONERANGE for the tail is needed. */
+	*path = COPY_PATH_REFLINK;
+	if(ioctl(dest, FICLONE, src) != 0) {
+		return -1;
+	}
+
+	progress_add(src_stat.st_size);
+	return src_stat.st_size;
+}
@@ -0,0 +1,190 @@
+/*
+ * CopyRing.c
+ * Author: Christian Würthner
+ * Description: Ring buffer in shared memory moving data between two processes.
+ */
+
+#include "CopyEngine.h"
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+/* Keeps the fields of the producer and the consumer on their own cache lines */
+#define RING_CACHE_LINE 64
+
+/* Header at the start of the mapping, the slots follow it */
+struct copy_ring {
+	/* Written by the producer */
+	uint32_t head;
+	uint32_t done;
+	uint32_t producer_waiting;
+	uint32_t producer_wake;
+	uint64_t producer_waits;
+	uint8_t producer_padding[RING_CACHE_LINE - 24];
+
+	/* Written by the consumer */
+	uint32_t tail;
+	uint32_t consumer_waiting;
+	uint32_t consumer_wake;
+	uint32_t aborted;
+	uint64_t consumer_waits;
+	uint8_t consumer_padding[RING_CACHE_LINE - 24];
+
+	/* Layout */
+	uint32_t slot_count;
+	uint32_t slot_size;
+	size_t mapping_size;
+	uint32_t lengths[];
+};
+
+/* Returns the data of the slot for the given sequence number */
+static uint8_t *ring_slot(copy_ring_t *ring, uint32_t sequence);
+
+/* Sleeps until *wake changes from seen */
+static void ring_wait(uint32_t *wake, uint32_t seen);
+
+/* Wakes the other side if it is sleeping */
+static void ring_wake(uint32_t *waiting, uint32_t *wake);
+
+copy_ring_t *ring_create(uint32_t slot_count, uint32_t slot_size) {
+	/* Place the slots behind the header, aligned to pages so reads and writes stay aligned */
+	size_t header_size = sizeof(copy_ring_t) + sizeof(uint32_t) * slot_count;
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	header_size = (header_size + page_size - 1) / page_size * page_size;
+	size_t mapping_size = header_size + (size_t) slot_count * slot_size;
+
+	/* Anonymous shared memory is inherited by children created with fork() */
+	copy_ring_t *ring = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(ring == MAP_FAILED) {
+		return NULL;
+	}
+
+	/* The mapping is zeroed, only the layout is set */
+	ring->slot_count = slot_count;
+	ring->slot_size = slot_size;
+	ring->mapping_size = mapping_size;
+
+	return ring;
+}
+
+void ring_destroy(copy_ring_t *ring) {
+	munmap(ring, ring->mapping_size);
+}
+
+int64_t ring_produce(copy_ring_t *ring, int src) {
+	uint64_t copied_count = 0;
+	uint32_t head = ring->head;
+
+	while(true) {
+		/* Wait for a free slot, only a full ring costs a syscall */
+		uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+		if(head - tail == ring->slot_count) {
+			uint32_t seen = __atomic_load_n(&ring->producer_wake, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&ring->producer_waiting, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&ring->aborted, __ATOMIC_SEQ_CST)) {
+				ring->producer_waits++;
+				ring_wait(&ring->producer_wake, seen);
+			}
+			__atomic_store_n(&ring->producer_waiting, 0, __ATOMIC_RELAXED);
+			if(__atomic_load_n(&ring->aborted, __ATOMIC_ACQUIRE)) {
+				errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+
+		/* Fill the slot */
+		ssize_t read_count = read(src, ring_slot(ring, head), ring->slot_size);
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			ring_abort(ring);
+			return -1;
+		}
+
+		/* Mark the end of the data */
+		if(read_count == 0) {
+			__atomic_store_n(&ring->done, 1, __ATOMIC_SEQ_CST);
+			ring_wake(&ring->consumer_waiting, &ring->consumer_wake);
+			return copied_count;
+		}
+
+		/* Publish the slot */
+		ring->lengths[head % ring->slot_count] = read_count;
+		__atomic_store_n(&ring->head, ++head, __ATOMIC_SEQ_CST);
+		ring_wake(&ring->consumer_waiting, &ring->consumer_wake);
+		copied_count += read_count;
+	}
+}
+
+int64_t ring_consume(copy_ring_t *ring, int dest) {
+	uint64_t copied_count = 0;
+	uint32_t tail = ring->tail;
+
+	while(true) {
+		/* Wait for a filled slot, only an empty ring costs a syscall */
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		if(head == tail) {
+			if(__atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) && __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == tail) {
+				return copied_count;
+			}
+			uint32_t seen = __atomic_load_n(&ring->consumer_wake, __ATOMIC_SEQ_CST);
+			__atomic_store_n(&ring->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+			if(__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) == tail && !__atomic_load_n(&ring->done, __ATOMIC_SEQ_CST) &&
+				!__atomic_load_n(&ring->aborted, __ATOMIC_SEQ_CST)) {
+				ring->consumer_waits++;
+				ring_wait(&ring->consumer_wake, seen);
+			}
+			__atomic_store_n(&ring->consumer_waiting, 0, __ATOMIC_RELAXED);
+			if(__atomic_load_n(&ring->aborted, __ATOMIC_ACQUIRE)) {
+				errno = EPIPE;
+				return -1;
+			}
+			continue;
+		}
+
+		/* Write the slot */
+		uint32_t length = ring->lengths[tail % ring->slot_count];
+		if(write_throttled(dest, ring_slot(ring, tail), length) != 0) {
+			ring_abort(ring);
+			return -1;
+		}
+		copied_count += length;
+		progress_add(length);
+
+		/* Release the slot */
+		__atomic_store_n(&ring->tail, ++tail, __ATOMIC_SEQ_CST);
+		ring_wake(&ring->producer_waiting, &ring->producer_wake);
+	}
+}
+
+void ring_waits(copy_ring_t *ring, uint64_t *producer_waits, uint64_t *consumer_waits) {
+	*producer_waits = ring->producer_waits;
+	*consumer_waits = ring->consumer_waits;
+}
+
+static uint8_t *ring_slot(copy_ring_t *ring, uint32_t sequence) {
+	return (uint8_t*) ring + (ring->mapping_size - (size_t) ring->slot_count * ring->slot_size) +
+		(size_t) (sequence % ring->slot_count) * ring->slot_size;
+}
+
+static void ring_wait(uint32_t *wake, uint32_t seen) {
+	/* Returns at once if the value already changed, spurious wakeups are checked by the caller */
+	syscall(SYS_futex, wake, FUTEX_WAIT, seen, NULL, NULL, 0);
+}
+
+static void ring_wake(uint32_t *waiting, uint32_t *wake) {
+	/* The other side announces before it sleeps, so the common case stays in user space */
+	if(__atomic_load_n(waiting, __ATOMIC_SEQ_CST)) {
+		__atomic_add_fetch(wake, 1, __ATOMIC_SEQ_CST);
+		syscall(SYS_futex, wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+	}
+}
+
+void ring_abort(copy_ring_t *ring) {
+	__atomic_store_n(&ring->aborted, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ring->producer_wake, 1, __ATOMIC_SEQ_CST);
+	__atomic_add_fetch(&ring->consumer_wake, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &ring->producer_wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+	syscall(SYS_futex, &ring->consumer_wake, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
@@ -0,0 +1,169 @@
+/*
+ * CopySparse.c
+ * Author: Christian Würthner
+ * Description: Copy engine path skipping holes and zero blocks.
+ */
+
+#include "CopyEngine.h"
+
+/* Checks if all bytes of the block are zero */
+static bool is_zero_block(const uint8_t *block, size_t length);
+
+/* Moves count bytes of holes to dest, either by seeking or by writing zeros to streams */
+static int write_hole(int dest, bool dest_seekable, uint64_t count, const uint8_t *zeros);
+
+/* Copies count bytes (or everything if count is UINT64_MAX) from the current position of src to
+   dest, skipping zero blocks on seekable destinations. Returns the bytes copied or -1. */
+static int64_t copy_data(int src, int dest, bool dest_seekable, uint64_t count, uint8_t *buffer, uint64_t *copied_count);
+
+int64_t copy_sparse(int src, int dest, copy_path_t *path) {
+	/* Holes can only be found in files and only be recreated in files */
+	struct stat src_stat, dest_stat;
+	if(fstat(src, &src_stat) != 0 || fstat(dest, &dest_stat) != 0) {
+		return -1;
+	}
+	bool src_seekable = S_ISREG(src_stat.st_mode) && src_stat.st_size > 0;
+	bool dest_seekable = S_ISREG(dest_stat.st_mode);
+	*path = COPY_PATH_SPARSE;
+
+	/* Use the buffer of this thread and a block of zeros for holes written to streams */
+	static const uint8_t zeros[COPY_BUFFER_SIZE];
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	uint64_t copied_count = 0;
+	int64_t result = 0;
+
+	/* Streams and files in /proc have no holes we could find, only zero blocks are detected */
+	if(!src_seekable) {
+		result = copy_data(src, dest, dest_seekable, UINT64_MAX, buffer, &copied_count);
+	}
+
+	/* Walk the data extents of the file, the filesystem tells us where the holes are.
+	   Filesystems without hole support report the whole file as one extent. */
+	else {
+		uint64_t size = src_stat.st_size;
+		while(copied_count < size && result >= 0) {
+			/* Find the next data, there is none if the file ends with a hole */
+			off_t data = lseek(src, copied_count, SEEK_DATA);
+			if(data < 0 && errno != ENXIO) {
+				result = -1;
+				break;
+			}
+			if(data < 0 || (uint64_t) data > size) {
+				data = size;
+			}
+
+			/* Find the end of the data */
+			off_t hole = data < (off_t) size ? lseek(src, data, SEEK_HOLE) : (off_t) size;
+			if(hole < 0) {
+				result = -1;
+				break;
+			}
+			if((uint64_t) hole > size) {
+				hole = size;
+			}
+
+			/* Skip the hole before the data */
+			if(write_hole(dest, dest_seekable, data - copied_count, zeros) != 0) {
+				result = -1;
+				break;
+			}
+			progress_add(data - copied_count);
+			copied_count = data;
+
+			/* Copy the data */
+			if(lseek(src, data, SEEK_SET) < 0) {
+				result = -1;
+				break;
+			}
+			result = copy_data(src, dest, dest_seekable, hole - data, buffer, &copied_count);
+		}
+	}
+
+	if(result < 0) {
+		return -1;
+	}
+
+	/* A hole at the end of the file is created by setting the size */
+	if(dest_seekable && ftruncate(dest, copied_count) != 0) {
+		return -1;
+	}
+
+	return copied_count;
+}
+
+static int64_t copy_data(int src, int dest, bool dest_seekable, uint64_t count, uint8_t *buffer, uint64_t *copied_count) {
+	uint64_t done = 0;
+
+	while(done < count) {
+		/* Read the next block */
+		size_t length = count - done < COPY_BUFFER_SIZE ? count - done : COPY_BUFFER_SIZE;
+		ssize_t read_count = read(src, buffer, length);
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if(read_count == 0) {
+			break;
+		}
+
+		/* Write the block in pieces, zero pieces are skipped in files */
+		for(ssize_t start=0; start<read_count; ) {
+			/* Find the end of the run of zero or non-zero pieces */
+			bool zero = dest_seekable && is_zero_block(buffer + start, read_count - start < COPY_SPARSE_BLOCK_SIZE ? read_count - start : COPY_SPARSE_BLOCK_SIZE);
+			ssize_t end = start;
+			while(end < read_count) {
+				size_t piece = read_count - end < COPY_SPARSE_BLOCK_SIZE ? read_count - end : COPY_SPARSE_BLOCK_SIZE;
+				if(dest_seekable && is_zero_block(buffer + end, piece) != zero) {
+					break;
+				}
+				end += piece;
+			}
+
+			/* Skip or write the run */
+			if(zero) {
+				if(lseek(dest, end - start, SEEK_CUR) < 0) {
+					return -1;
+				}
+			} else if(write_all(dest, buffer + start, end - start) != 0) {
+				return -1;
+			}
+
+			start = end;
+		}
+
+		done += read_count;
+		*copied_count += read_count;
+		progress_add(read_count);
+	}
+
+	return done;
+}
+
+static int write_hole(int dest, bool dest_seekable, uint64_t count, const uint8_t *zeros) {
+	/* Files get a real hole */
+	if(dest_seekable) {
+		return lseek(dest, count, SEEK_CUR) < 0 ? -1 : 0;
+	}
+
+	/* Streams get zeros */
+	while(count > 0) {
+		size_t length = count < COPY_BUFFER_SIZE ? count : COPY_BUFFER_SIZE;
+		if(write_all(dest, zeros, length) != 0) {
+			return -1;
+		}
+		count -= length;
+	}
+
+	return 0;
+}
+
+static bool is_zero_block(const uint8_t *block, size_t length) {
+	/* A block is zero if the first byte is zero and every byte equals its successor */
+	return length == 0 || (block[0] == 0 && memcmp(block, block + 1, length - 1) == 0);
+}
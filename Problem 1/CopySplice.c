@@ -0,0 +1,142 @@
+/*
+ * CopySplice.c
+ * Author: Christian Würthner
+ * Description: Copy path moving pages between files and pipes with splice(), and pipe tuning.
+ */
+
+#include "CopyEngine.h"
+
+/* Moves the bytes left in the pipe to dest with a read/write loop, returns 0 or -1 */
+static int drain_pipe(int pipe_fd, int dest, uint64_t count);
+
+int64_t copy_splice(int src, int dest, uint64_t count, copy_path_t *path) {
+	*path = COPY_PATH_SPLICE;
+
+	/* splice() needs a pipe on one side */
+	struct stat src_stat, dest_stat;
+	if(fstat(src, &src_stat) != 0 || fstat(dest, &dest_stat) != 0) {
+		return -1;
+	}
+	bool direct = S_ISFIFO(src_stat.st_mode) || S_ISFIFO(dest_stat.st_mode);
+
+	/* Without one, the pages go through a pipe of our own */
+	int pipe_fd[2] = {-1, -1};
+	if(!direct && pipe(pipe_fd) != 0) {
+		*path = COPY_PATH_READ_WRITE;
+		return copy_read_write_range(src, dest, count);
+	}
+
+	uint64_t copied_count = 0;
+	ssize_t done = 0;
+	while(copied_count < count) {
+		/* Move pages from src to dest or into our pipe, the pipe only takes what fits */
+		uint64_t length = count - copied_count < COPY_CHUNK_SIZE ? count - copied_count : COPY_CHUNK_SIZE;
+		done = splice(src, NULL, direct ? dest : pipe_fd[1], NULL, length, SPLICE_F_MOVE | SPLICE_F_MORE);
+		if(done < 0 && errno == EINTR) {
+			continue;
+		}
+		if(done <= 0) {
+			break;
+		}
+		if(direct) {
+			copied_count += done;
+			progress_add(done);
+			continue;
+		}
+
+		/* Move the pages out of our pipe to dest */
+		uint64_t pending = done;
+		while(pending > 0) {
+			ssize_t moved = splice(pipe_fd[0], NULL, dest, NULL, pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+			if(moved < 0 && errno == EINTR) {
+				continue;
+			}
+
+			/* The destination doesn't support splice(), hand over what is in the pipe */
+			if(moved < 0) {
+				if(!is_fallback_error(errno) || drain_pipe(pipe_fd[0], dest, pending) != 0) {
+					close(pipe_fd[0]);
+					close(pipe_fd[1]);
+					return -1;
+				}
+				moved = pending;
+				done = -1;
+				errno = EINVAL;
+			}
+
+			pending -= moved;
+			copied_count += moved;
+			progress_add(moved);
+		}
+		if(done < 0) {
+			break;
+		}
+	}
+
+	/* Close our pipe */
+	int error = errno;
+	if(!direct) {
+		close(pipe_fd[0]);
+		close(pipe_fd[1]);
+	}
+	errno = error;
+
+	/* Cancel on real errors, unsupported files continue where splice() stopped */
+	if(done < 0) {
+		if(!is_fallback_error(errno)) {
+			return -1;
+		}
+		*path = copied_count > 0 ? COPY_PATH_SPLICE : COPY_PATH_READ_WRITE;
+		int64_t result = copy_read_write_range(src, dest, count - copied_count);
+		if(result < 0) {
+			return -1;
+		}
+		copied_count += result;
+	}
+
+	return copied_count;
+}
+
+int pipe_set_size(int fd, uint64_t size) {
+	/* Read the limit for unprivileged users */
+	uint64_t max_size = COPY_PIPE_SIZE;
+	FILE *file = fopen("/proc/sys/fs/pipe-max-size", "r");
+	if(file != NULL) {
+		if(fscanf(file, "%" SCNu64, &max_size) != 1) {
+			max_size = COPY_PIPE_SIZE;
+		}
+		fclose(file);
+	}
+	if(size == 0 || size > max_size) {
+		size = max_size;
+	}
+
+	/* The pages of all pipes of a user are limited as well, so try smaller sizes until the
+	   kernel agrees */
+	int result;
+	while((result = fcntl(fd, F_SETPIPE_SZ, (int) size)) < 0 && errno == EPERM && size > 2 * getpagesize()) {
+		size /= 2;
+	}
+
+	return result;
+}
+
+static int drain_pipe(int pipe_fd, int dest, uint64_t count) {
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	while(count > 0) {
+		ssize_t read_count = read(pipe_fd, buffer, count < COPY_BUFFER_SIZE ? count : COPY_BUFFER_SIZE);
+		if(read_count < 0 && errno == EINTR) {
+			continue;
+		}
+		if(read_count <= 0 || write_all(dest, buffer, read_count) != 0) {
+			return -1;
+		}
+		count -= read_count;
+	}
+
+	return 0;
+}
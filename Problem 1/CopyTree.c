@@ -0,0 +1,443 @@
+/*
+ * CopyTree.c
+ * Author: Christian Würthner
+ * Description: Recursive directory copy with a pool of workers draining a shared work queue.
+ */
+
+#include "CopyEngine.h"
+#include <sys/syscall.h>
+#include <dirent.h>
+
+/* Size of the buffer for one getdents64() call */
+#define TREE_DIRENT_BUFFER_SIZE (64 * 1024)
+
+/* Entry returned by getdents64() */
+typedef struct {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+} tree_dirent_t;
+
+/* An opened pair of directories, shared by all items inside them */
+typedef struct {
+	int src_fd;
+	int dest_fd;
+	char *path;
+	uint32_t references;
+} tree_dir_t;
+
+/* The kinds of work in the queue */
+typedef enum {
+	TREE_ITEM_SCAN,
+	TREE_ITEM_FILE
+} tree_item_type_t;
+
+/* One unit of work, scanning a directory or copying a file inside a directory. Both name an entry
+   of dir, only the root is scanned without a name. A directory is opened when it is scanned, so
+   queued directories don't hold descriptors. */
+typedef struct {
+	tree_item_type_t type;
+	tree_dir_t *dir;
+	char *name;
+} tree_item_t;
+
+/* Bounded queue shared by all workers, every worker takes and adds items */
+typedef struct {
+	tree_item_t *items;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	uint64_t pending;
+	uint32_t open_dirs;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	bool truncate;
+	copy_function_t copy;
+	void *context;
+	tree_stats_t *stats;
+} tree_queue_t;
+
+/* Worker taking items until the whole tree is copied */
+static void *tree_worker(void *args_v);
+
+/* Processes one item and releases its directory */
+static void tree_process(tree_queue_t *queue, tree_item_t *item);
+
+/* Adds an item if the queue has room, returns false if it is full */
+static bool tree_try_push(tree_queue_t *queue, tree_item_t *item);
+
+/* Reads all entries of a directory and queues (or processes) them */
+static void tree_scan(tree_queue_t *queue, tree_dir_t *dir);
+
+/* Opens a directory entry and creates and opens its destination, returns NULL on errors */
+static tree_dir_t *tree_enter(tree_queue_t *queue, tree_dir_t *parent, const char *name);
+
+/* Copies one regular file or symbolic link */
+static void tree_copy_file(tree_queue_t *queue, tree_dir_t *dir, const char *name);
+
+/* Creates a directory handle with one reference, path is the destination path for messages */
+static tree_dir_t *tree_dir_create(tree_queue_t *queue, int src_fd, int dest_fd, const char *parent_path, const char *name);
+
+/* Returns the destination path of an entry in the directory, must be freed */
+static char *tree_path(tree_dir_t *dir, const char *name);
+
+/* Drops a reference to the directory, closes it when it is no longer used */
+static void tree_dir_release(tree_queue_t *queue, tree_dir_t *dir);
+
+/* Counts a failed item */
+static void tree_error(tree_queue_t *queue, tree_dir_t *dir, const char *name, const char *action);
+
+int copy_tree(const char *src, const char *dest, uint32_t worker_count, bool truncate, copy_function_t copy, void *context, tree_stats_t *stats) {
+	memset(stats, 0, sizeof(tree_stats_t));
+
+	/* Open the source directory */
+	int src_fd = open(src, O_RDONLY | O_DIRECTORY);
+	if(src_fd < 0) {
+		return -1;
+	}
+
+	/* Create and open the destination directory */
+	struct stat src_stat;
+	if(fstat(src_fd, &src_stat) != 0 || (mkdir(dest, (src_stat.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST)) {
+		int error = errno;
+		close(src_fd);
+		errno = error;
+		return -1;
+	}
+	int dest_fd = open(dest, O_RDONLY | O_DIRECTORY);
+	if(dest_fd < 0) {
+		close(src_fd);
+		return -1;
+	}
+
+	/* Create the queue */
+	if(worker_count == 0) {
+		worker_count = COPY_TREE_WORKERS;
+	}
+	tree_queue_t queue;
+	memset(&queue, 0, sizeof(tree_queue_t));
+	queue.capacity = COPY_TREE_QUEUE_SIZE;
+	queue.items = malloc(sizeof(tree_item_t) * queue.capacity);
+	queue.truncate = truncate;
+	queue.copy = copy;
+	queue.context = context;
+	queue.stats = stats;
+	pthread_mutex_init(&queue.mutex, NULL);
+	pthread_cond_init(&queue.changed, NULL);
+	if(queue.items == NULL) {
+		close(src_fd);
+		close(dest_fd);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* The root directory is the first item */
+	tree_item_t root = {TREE_ITEM_SCAN, tree_dir_create(&queue, src_fd, dest_fd, NULL, dest), NULL};
+	tree_try_push(&queue, &root);
+
+	/* Start the workers, the current thread works as well */
+	pthread_t *threads = malloc(sizeof(pthread_t) * worker_count);
+	uint32_t started = 0;
+	for(; threads != NULL && started<worker_count - 1; started++) {
+		if(pthread_create(threads + started, NULL, tree_worker, (void*) &queue) != 0) {
+			break;
+		}
+	}
+	tree_worker(&queue);
+
+	/* Wait for all workers */
+	for(uint32_t i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	/* Free everything */
+	free(threads);
+	free(queue.items);
+	pthread_mutex_destroy(&queue.mutex);
+	pthread_cond_destroy(&queue.changed);
+
+	return 0;
+}
+
+static void *tree_worker(void *args_v) {
+	tree_queue_t *queue = (tree_queue_t*) args_v;
+
+	while(true) {
+		/* Wait for an item, we are done when nothing is queued or in progress */
+		pthread_mutex_lock(&queue->mutex);
+		while(queue->count == 0 && queue->pending > 0) {
+			pthread_cond_wait(&queue->changed, &queue->mutex);
+		}
+		if(queue->count == 0) {
+			pthread_mutex_unlock(&queue->mutex);
+			break;
+		}
+
+		/* Take the item */
+		tree_item_t item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_mutex_unlock(&queue->mutex);
+
+		/* Process it, only then it is no longer pending */
+		tree_process(queue, &item);
+		pthread_mutex_lock(&queue->mutex);
+		queue->pending--;
+		if(queue->pending == 0) {
+			pthread_cond_broadcast(&queue->changed);
+		}
+		pthread_mutex_unlock(&queue->mutex);
+	}
+
+	return NULL;
+}
+
+static bool tree_try_push(tree_queue_t *queue, tree_item_t *item) {
+	pthread_mutex_lock(&queue->mutex);
+
+	/* A full queue is not waited for, the caller processes the item itself. Otherwise workers
+	   could block each other while adding. */
+	if(queue->count == queue->capacity) {
+		pthread_mutex_unlock(&queue->mutex);
+		return false;
+	}
+
+	/* Append the item and wake a worker */
+	queue->items[(queue->head + queue->count) % queue->capacity] = *item;
+	queue->count++;
+	queue->pending++;
+	pthread_cond_signal(&queue->changed);
+	pthread_mutex_unlock(&queue->mutex);
+
+	return true;
+}
+
+static void tree_process(tree_queue_t *queue, tree_item_t *item) {
+	if(item->type == TREE_ITEM_SCAN && item->name == NULL) {
+		tree_scan(queue, item->dir);
+	} else if(item->type == TREE_ITEM_SCAN) {
+		tree_dir_t *dir = tree_enter(queue, item->dir, item->name);
+		if(dir != NULL) {
+			tree_scan(queue, dir);
+			tree_dir_release(queue, dir);
+		}
+	} else {
+		tree_copy_file(queue, item->dir, item->name);
+	}
+
+	free(item->name);
+	tree_dir_release(queue, item->dir);
+}
+
+static void tree_scan(tree_queue_t *queue, tree_dir_t *dir) {
+	/* Create buffer for the entries */
+	uint8_t *buffer = malloc(TREE_DIRENT_BUFFER_SIZE);
+	if(buffer == NULL) {
+		tree_error(queue, dir, ".", "scan directory");
+		return;
+	}
+
+	/* Every queued entry keeps this directory open. If too many are open already, the entries
+	   are processed here, so the descriptors stay within the limit of the process. */
+	bool queue_entries = __atomic_load_n(&queue->open_dirs, __ATOMIC_RELAXED) <= COPY_TREE_OPEN_DIRS;
+
+	/* Read the entries in batches, no stat() is needed for most filesystems */
+	long read_count;
+	while((read_count = syscall(SYS_getdents64, dir->src_fd, buffer, TREE_DIRENT_BUFFER_SIZE)) > 0) {
+		for(long offset=0; offset<read_count; ) {
+			tree_dirent_t *entry = (tree_dirent_t*) (buffer + offset);
+			offset += entry->d_reclen;
+
+			/* Skip the current and the parent directory */
+			if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+				continue;
+			}
+
+			/* Some filesystems don't report the type */
+			unsigned char type = entry->d_type;
+			if(type == DT_UNKNOWN) {
+				struct stat entry_stat;
+				if(fstatat(dir->src_fd, entry->d_name, &entry_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+					tree_error(queue, dir, entry->d_name, "stat");
+					continue;
+				}
+				type = S_ISDIR(entry_stat.st_mode) ? DT_DIR : S_ISREG(entry_stat.st_mode) ? DT_REG : S_ISLNK(entry_stat.st_mode) ? DT_LNK : DT_UNKNOWN;
+			}
+
+			/* Directories, files and links are queued for the workers, or processed here if the
+			   queue is full */
+			if(type == DT_DIR || type == DT_REG || type == DT_LNK) {
+				__atomic_add_fetch(&dir->references, 1, __ATOMIC_RELAXED);
+				tree_item_t item = {type == DT_DIR ? TREE_ITEM_SCAN : TREE_ITEM_FILE, dir, strdup(entry->d_name)};
+				if(item.name == NULL) {
+					printf("ERROR: Out of memory!\n");
+					exit(5);
+				}
+				if(!queue_entries || !tree_try_push(queue, &item)) {
+					tree_process(queue, &item);
+				}
+			}
+
+			/* Devices, sockets and fifos are not copied */
+			else {
+				printf("SKIP: \"%s\" is no regular file, link or directory\n", entry->d_name);
+			}
+		}
+	}
+
+	/* Check for read errors */
+	if(read_count < 0) {
+		tree_error(queue, dir, ".", "scan directory");
+	}
+
+	free(buffer);
+}
+
+static tree_dir_t *tree_enter(tree_queue_t *queue, tree_dir_t *parent, const char *name) {
+	/* Open the source directory relative to its parent */
+	int src_fd = openat(parent->src_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(src_fd < 0) {
+		tree_error(queue, parent, name, "open directory");
+		return NULL;
+	}
+
+	/* Create and open the destination directory */
+	struct stat src_stat;
+	if(fstat(src_fd, &src_stat) != 0) {
+		tree_error(queue, parent, name, "stat");
+		close(src_fd);
+		return NULL;
+	}
+	if(mkdirat(parent->dest_fd, name, (src_stat.st_mode & 07777) | S_IRWXU) != 0 && errno != EEXIST) {
+		tree_error(queue, parent, name, "create directory");
+		close(src_fd);
+		return NULL;
+	}
+	int dest_fd = openat(parent->dest_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
+	if(dest_fd < 0) {
+		tree_error(queue, parent, name, "open directory");
+		close(src_fd);
+		return NULL;
+	}
+
+	return tree_dir_create(queue, src_fd, dest_fd, parent->path, name);
+}
+
+static void tree_copy_file(tree_queue_t *queue, tree_dir_t *dir, const char *name) {
+	/* Check the type again, the item may be a link */
+	struct stat src_stat;
+	if(fstatat(dir->src_fd, name, &src_stat, AT_SYMLINK_NOFOLLOW) != 0) {
+		tree_error(queue, dir, name, "stat");
+		return;
+	}
+
+	/* Links are recreated, not followed */
+	if(S_ISLNK(src_stat.st_mode)) {
+		char target[PATH_MAX];
+		ssize_t length = readlinkat(dir->src_fd, name, target, sizeof(target) - 1);
+		if(length < 0) {
+			tree_error(queue, dir, name, "read link");
+			return;
+		}
+		target[length] = 0;
+
+		/* Replace an existing link */
+		unlinkat(dir->dest_fd, name, 0);
+		if(symlinkat(target, dir->dest_fd, name) != 0) {
+			tree_error(queue, dir, name, "create link");
+			return;
+		}
+
+		__atomic_add_fetch(&queue->stats->file_count, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	/* Open both files relative to their directories */
+	int src = openat(dir->src_fd, name, O_RDONLY | O_NOFOLLOW);
+	if(src < 0) {
+		tree_error(queue, dir, name, "open source file");
+		return;
+	}
+	int dest = openat(dir->dest_fd, name, O_RDWR | O_CREAT | (queue->truncate ? O_TRUNC : 0) | O_NOFOLLOW, src_stat.st_mode & 07777);
+	if(dest < 0) {
+		tree_error(queue, dir, name, "create destination file");
+		close(src);
+		return;
+	}
+
+	/* Copy with the function of the caller */
+	copy_path_t path = COPY_PATH_NONE;
+	char *dest_path = tree_path(dir, name);
+	int64_t copied_count = queue->copy(src, dest, dest_path, queue->context, &path);
+	free(dest_path);
+	close(src);
+	if(close(dest) != 0 || copied_count < 0) {
+		tree_error(queue, dir, name, "copy");
+		return;
+	}
+
+	/* Count the file */
+	__atomic_add_fetch(&queue->stats->file_count, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queue->stats->copied_count, copied_count, __ATOMIC_RELAXED);
+}
+
+static tree_dir_t *tree_dir_create(tree_queue_t *queue, int src_fd, int dest_fd, const char *parent_path, const char *name) {
+	/* Create the handle */
+	tree_dir_t *dir = malloc(sizeof(tree_dir_t));
+	if(dir == NULL) {
+		printf("ERROR: Out of memory!\n");
+		exit(5);
+	}
+
+	/* The root is named by the caller, all others are named relative to their parent */
+	if(parent_path == NULL) {
+		dir->path = strdup(name);
+	} else {
+		dir->path = malloc(strlen(parent_path) + strlen(name) + 2);
+		if(dir->path != NULL) {
+			sprintf(dir->path, "%s/%s", parent_path, name);
+		}
+	}
+	if(dir->path == NULL) {
+		printf("ERROR: Out of memory!\n");
+		exit(5);
+	}
+
+	dir->src_fd = src_fd;
+	dir->dest_fd = dest_fd;
+	dir->references = 1;
+	__atomic_add_fetch(&queue->open_dirs, 1, __ATOMIC_RELAXED);
+
+	return dir;
+}
+
+static void tree_dir_release(tree_queue_t *queue, tree_dir_t *dir) {
+	if(__atomic_sub_fetch(&dir->references, 1, __ATOMIC_ACQ_REL) == 0) {
+		close(dir->src_fd);
+		close(dir->dest_fd);
+		__atomic_sub_fetch(&queue->open_dirs, 1, __ATOMIC_RELAXED);
+		free(dir->path);
+		free(dir);
+	}
+}
+
+static char *tree_path(tree_dir_t *dir, const char *name) {
+	char *path = malloc(strlen(dir->path) + strlen(name) + 2);
+	if(path == NULL) {
+		printf("ERROR: Out of memory!\n");
+		exit(5);
+	}
+
+	sprintf(path, "%s/%s", dir->path, name);
+	return path;
+}
+
+static void tree_error(tree_queue_t *queue, tree_dir_t *dir, const char *name, const char *action) {
+	int error = errno;
+	char *path = tree_path(dir, name);
+	printf("ERROR: Unable to %s \"%s\" (%s)\n", action, path, strerror(error));
+	free(path);
+	__atomic_add_fetch(&queue->stats->error_count, 1, __ATOMIC_RELAXED);
+}
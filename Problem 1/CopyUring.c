@@ -0,0 +1,461 @@
+/*
+ * CopyUring.c
+ * Author: Christian Würthner
+ * Description: Copy engine path keeping many reads and writes in flight with io_uring.
+ */
+
+#include "CopyEngine.h"
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+/* Structure holding the mapped rings of one io_uring instance */
+typedef struct {
+	int fd;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_ring_size;
+	size_t cq_ring_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t *sq_mask;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t *cq_mask;
+	struct io_uring_cqe *cqes;
+	uint32_t to_submit;
+} uring_t;
+
+/* One buffer with the range of the file it currently moves */
+typedef struct {
+	bool active;
+	uint8_t inflight;
+	uint64_t seq;
+	int64_t src_offset;
+	int64_t dest_offset;
+	uint64_t length;
+	uint64_t filled;
+	uint64_t written;
+	uint8_t *buffer;
+} uring_slot_t;
+
+/* Shared state of one io_uring copy */
+typedef struct {
+	uring_t ring;
+	int src;
+	int dest;
+	bool src_seekable;
+	bool dest_seekable;
+	bool fixed;
+	uint64_t size;
+	uint64_t read_offset;
+	uint64_t stream_offset;
+	uint64_t next_seq;
+	uint64_t write_seq;
+	bool stream_reading;
+	bool ordered_writing;
+	bool eof;
+	int error;
+	uint64_t copied_count;
+	uint32_t slot_count;
+	uring_slot_t *slots;
+} uring_copy_t;
+
+/* Creates the ring and maps the queues, returns 0 or -1 */
+static int uring_init(uring_t *ring, uint32_t entries);
+
+/* Unmaps the queues and closes the ring */
+static void uring_free(uring_t *ring);
+
+/* Appends a read or write to the submission queue */
+static void uring_queue(uring_copy_t *copy, uint32_t index, bool write, uint64_t start, uint64_t end, bool link);
+
+/* Decides and queues the next operation of an idle slot */
+static void uring_schedule(uring_copy_t *copy, uint32_t index);
+
+/* Processes one completion */
+static void uring_complete(uring_copy_t *copy, struct io_uring_cqe *cqe);
+
+int64_t copy_uring(int src, int dest, uint32_t queue_depth, copy_path_t *path) {
+	/* Files with a known size can be read at offsets, everything else is read in order */
+	struct stat src_stat, dest_stat;
+	if(fstat(src, &src_stat) != 0 || fstat(dest, &dest_stat) != 0) {
+		return -1;
+	}
+
+	/* Create the shared state */
+	uring_copy_t copy;
+	memset(&copy, 0, sizeof(uring_copy_t));
+	copy.src = src;
+	copy.dest = dest;
+	copy.src_seekable = S_ISREG(src_stat.st_mode) && src_stat.st_size > 0;
+	copy.dest_seekable = S_ISREG(dest_stat.st_mode);
+	copy.size = src_stat.st_size;
+	copy.slot_count = queue_depth > 0 ? queue_depth : COPY_URING_QUEUE_DEPTH;
+	if(copy.slot_count > COPY_URING_MAX_QUEUE_DEPTH) {
+		copy.slot_count = COPY_URING_MAX_QUEUE_DEPTH;
+	}
+
+	/* Create the ring, every slot has at most a read and a write in flight. Kernels without
+	   io_uring (or where it is disabled) use the normal engine. */
+	if(uring_init(&copy.ring, copy.slot_count * 2) != 0) {
+		return copy_kernel(src, dest, path);
+	}
+	*path = COPY_PATH_IO_URING;
+
+	/* Allocate all buffers at once, page aligned */
+	uint8_t *buffers = mmap(NULL, (size_t) copy.slot_count * COPY_URING_BLOCK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	copy.slots = calloc(copy.slot_count, sizeof(uring_slot_t));
+	struct iovec *iovecs = calloc(copy.slot_count, sizeof(struct iovec));
+	if(buffers == MAP_FAILED || copy.slots == NULL || iovecs == NULL) {
+		if(buffers != MAP_FAILED) {
+			munmap(buffers, (size_t) copy.slot_count * COPY_URING_BLOCK_SIZE);
+		}
+		free(copy.slots);
+		free(iovecs);
+		uring_free(&copy.ring);
+		errno = ENOMEM;
+		return -1;
+	}
+	for(uint32_t i=0; i<copy.slot_count; i++) {
+		copy.slots[i].buffer = buffers + (size_t) i * COPY_URING_BLOCK_SIZE;
+		iovecs[i].iov_base = copy.slots[i].buffer;
+		iovecs[i].iov_len = COPY_URING_BLOCK_SIZE;
+	}
+
+	/* Register the buffers so the kernel doesn't map them for every request. If the memlock
+	   limit doesn't allow it, the plain read and write opcodes are used. */
+	copy.fixed = syscall(__NR_io_uring_register, copy.ring.fd, IORING_REGISTER_BUFFERS, iovecs, copy.slot_count) == 0;
+	free(iovecs);
+
+	/* Run until everything is read and written or an error occured and all requests returned */
+	while(true) {
+		/* Let every idle slot start its next operation */
+		for(uint32_t i=0; i<copy.slot_count; i++) {
+			if(copy.slots[i].inflight == 0) {
+				uring_schedule(&copy, i);
+			}
+		}
+
+		/* Count the requests in flight and the slots still in use */
+		uint32_t inflight = copy.ring.to_submit;
+		bool active = false;
+		for(uint32_t i=0; i<copy.slot_count; i++) {
+			inflight += copy.slots[i].inflight;
+			active |= copy.slots[i].active;
+		}
+
+		/* We are done if no slot is in use. Slots waiting for their turn to write are
+		   scheduled again when nothing is in flight. */
+		if(inflight == 0) {
+			if(!active) {
+				break;
+			}
+			continue;
+		}
+
+		/* Submit the queued requests and wait for at least one completion */
+		int result = syscall(__NR_io_uring_enter, copy.ring.fd, copy.ring.to_submit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(result < 0) {
+			if(errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+				copy.error = errno;
+				break;
+			}
+
+			/* Nothing was submitted. EBUSY means the completion queue is full, so it has to be
+			   drained before the requests can be submitted again. */
+			result = 0;
+		}
+		copy.ring.to_submit -= result;
+
+		/* Process all completions */
+		uint32_t head = *copy.ring.cq_head;
+		while(head != __atomic_load_n(copy.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			uring_complete(&copy, copy.ring.cqes + (head & *copy.ring.cq_mask));
+			head++;
+		}
+		__atomic_store_n(copy.ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* After an error the kernel may still work on submitted requests. Closing the ring doesn't wait
+	   for them, so their completions are reaped before the buffers are freed. Requests that were
+	   queued but never submitted are not counted. */
+	uint32_t submitted = 0;
+	for(uint32_t i=0; i<copy.slot_count; i++) {
+		submitted += copy.slots[i].inflight;
+	}
+	submitted -= copy.ring.to_submit;
+	while(submitted > 0) {
+		if(syscall(__NR_io_uring_enter, copy.ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+			break;
+		}
+
+		uint32_t head = *copy.ring.cq_head;
+		while(head != __atomic_load_n(copy.ring.cq_tail, __ATOMIC_ACQUIRE)) {
+			uring_complete(&copy, copy.ring.cqes + (head & *copy.ring.cq_mask));
+			head++;
+			submitted--;
+		}
+		__atomic_store_n(copy.ring.cq_head, head, __ATOMIC_RELEASE);
+	}
+
+	/* Free everything. If requests couldn't be reaped, the buffers are leaked rather than
+	   handed back while the kernel may still write into them. */
+	uring_free(&copy.ring);
+	if(submitted == 0) {
+		munmap(buffers, (size_t) copy.slot_count * COPY_URING_BLOCK_SIZE);
+	}
+	free(copy.slots);
+
+	/* Report the first error */
+	if(copy.error != 0) {
+		errno = copy.error;
+		return -1;
+	}
+
+	return copy.copied_count;
+}
+
+static int uring_init(uring_t *ring, uint32_t entries) {
+	memset(ring, 0, sizeof(uring_t));
+
+	/* Create the ring */
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+	if(ring->fd < 0) {
+		return -1;
+	}
+
+	/* Calculate the sizes of the rings, newer kernels map both with one call */
+	ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+
+	/* Map the submission ring */
+	ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if(ring->sq_ring == MAP_FAILED) {
+		close(ring->fd);
+		return -1;
+	}
+
+	/* Map the completion ring */
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if(ring->cq_ring == MAP_FAILED) {
+			munmap(ring->sq_ring, ring->sq_ring_size);
+			close(ring->fd);
+			return -1;
+		}
+	}
+
+	/* Map the submission queue entries */
+	ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED) {
+		if(ring->cq_ring != ring->sq_ring) {
+			munmap(ring->cq_ring, ring->cq_ring_size);
+		}
+		munmap(ring->sq_ring, ring->sq_ring_size);
+		close(ring->fd);
+		return -1;
+	}
+
+	/* Set the pointers into the rings */
+	uint8_t *sq = ring->sq_ring;
+	uint8_t *cq = ring->cq_ring;
+	ring->sq_head = (uint32_t*) (sq + params.sq_off.head);
+	ring->sq_tail = (uint32_t*) (sq + params.sq_off.tail);
+	ring->sq_mask = (uint32_t*) (sq + params.sq_off.ring_mask);
+	ring->sq_array = (uint32_t*) (sq + params.sq_off.array);
+	ring->cq_head = (uint32_t*) (cq + params.cq_off.head);
+	ring->cq_tail = (uint32_t*) (cq + params.cq_off.tail);
+	ring->cq_mask = (uint32_t*) (cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+	return 0;
+}
+
+static void uring_free(uring_t *ring) {
+	munmap(ring->sqes, ring->sqes_size);
+	if(ring->cq_ring != ring->sq_ring) {
+		munmap(ring->cq_ring, ring->cq_ring_size);
+	}
+	munmap(ring->sq_ring, ring->sq_ring_size);
+	close(ring->fd);
+}
+
+static void uring_queue(uring_copy_t *copy, uint32_t index, bool write, uint64_t start, uint64_t end, bool link) {
+	uring_slot_t *slot = copy->slots + index;
+	uring_t *ring = &copy->ring;
+
+	/* Take the next free entry, the ring has room for two requests per slot */
+	uint32_t tail = *ring->sq_tail;
+	uint32_t entry = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = ring->sqes + entry;
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+
+	/* Fill the request, streams ignore the offset and use their current position */
+	if(write) {
+		sqe->opcode = copy->fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+		sqe->fd = copy->dest;
+		sqe->off = copy->dest_seekable ? (uint64_t) (slot->dest_offset + start) : (uint64_t) -1;
+	} else {
+		sqe->opcode = copy->fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+		sqe->fd = copy->src;
+		sqe->off = copy->src_seekable ? (uint64_t) (slot->src_offset + start) : (uint64_t) -1;
+	}
+	sqe->addr = (uint64_t) (uintptr_t) (slot->buffer + start);
+	sqe->len = end - start;
+	sqe->buf_index = copy->fixed ? index : 0;
+	sqe->flags = link ? IOSQE_IO_LINK : 0;
+	sqe->user_data = ((uint64_t) index << 1) | (write ? 1 : 0);
+
+	/* Publish the entry */
+	ring->sq_array[entry] = entry;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->to_submit++;
+	slot->inflight++;
+}
+
+static void uring_schedule(uring_copy_t *copy, uint32_t index) {
+	uring_slot_t *slot = copy->slots + index;
+
+	/* Start a new range on a free slot, as long as there is something left and no error */
+	if(!slot->active) {
+		if(copy->error != 0 || copy->eof) {
+			return;
+		}
+
+		/* Ranges of files are read in parallel */
+		if(copy->src_seekable) {
+			if(copy->read_offset >= copy->size) {
+				copy->eof = true;
+				return;
+			}
+			slot->src_offset = copy->read_offset;
+			slot->dest_offset = copy->read_offset;
+			slot->length = copy->size - copy->read_offset;
+			if(slot->length > COPY_URING_BLOCK_SIZE) {
+				slot->length = COPY_URING_BLOCK_SIZE;
+			}
+			copy->read_offset += slot->length;
+		}
+
+		/* Streams are read one request after the other */
+		else {
+			if(copy->stream_reading) {
+				return;
+			}
+			copy->stream_reading = true;
+			slot->length = COPY_URING_BLOCK_SIZE;
+		}
+
+		/* Activate slot */
+		slot->active = true;
+		slot->seq = copy->next_seq++;
+		slot->filled = 0;
+		slot->written = 0;
+	}
+
+	/* After an error the slot is only released */
+	if(copy->error != 0) {
+		slot->active = false;
+		return;
+	}
+
+	/* Everything of the range is written, release the slot */
+	if(slot->written == slot->length) {
+		slot->active = false;
+		if(!copy->dest_seekable) {
+			copy->write_seq++;
+		}
+		if(slot->length > 0) {
+			copy->copied_count += slot->length;
+			progress_add(slot->length);
+		}
+
+		/* Start the next range immediately */
+		uring_schedule(copy, index);
+		return;
+	}
+
+	/* Streams must be written in order with only one write in flight */
+	bool may_write = copy->dest_seekable || (slot->seq == copy->write_seq && !copy->ordered_writing);
+	bool may_link = copy->src_seekable && copy->dest_seekable;
+
+	/* Write data that was read but not written yet */
+	if(slot->filled > slot->written) {
+		if(may_write) {
+			copy->ordered_writing = !copy->dest_seekable;
+			uring_queue(copy, index, true, slot->written, slot->filled, false);
+		}
+		return;
+	}
+
+	/* Read the rest of the range, between two files the write is linked to the read and is
+	   started by the kernel as soon as the read completes. A short read cancels the write. */
+	if(may_link) {
+		uring_queue(copy, index, false, slot->filled, slot->length, true);
+		uring_queue(copy, index, true, slot->filled, slot->length, false);
+	} else {
+		uring_queue(copy, index, false, slot->filled, slot->length, false);
+	}
+}
+
+static void uring_complete(uring_copy_t *copy, struct io_uring_cqe *cqe) {
+	uring_slot_t *slot = copy->slots + (cqe->user_data >> 1);
+	bool write = cqe->user_data & 1;
+	int result = cqe->res;
+	slot->inflight--;
+
+	/* The next ordered write may be started */
+	if(write && !copy->dest_seekable) {
+		copy->ordered_writing = false;
+	}
+
+	/* Interrupted requests and writes canceled by a short read are simply scheduled again */
+	if(result == -EINTR || result == -EAGAIN || result == -ECANCELED) {
+		return;
+	}
+
+	/* Save the first error */
+	if(result < 0) {
+		if(copy->error == 0) {
+			copy->error = -result;
+		}
+		return;
+	}
+
+	/* Count written bytes */
+	if(write) {
+		slot->written += result;
+		return;
+	}
+
+	/* Count read bytes, a stream read is done with whatever it returned */
+	slot->filled += result;
+	if(!copy->src_seekable) {
+		slot->length = slot->filled;
+		slot->dest_offset = copy->stream_offset;
+		copy->stream_offset += result;
+		copy->stream_reading = false;
+		copy->eof = result == 0;
+	}
+
+	/* The file got shorter while copying, stop after this range */
+	else if(result == 0) {
+		slot->length = slot->filled;
+		copy->eof = true;
+	}
+}
@@ -0,0 +1,171 @@
+/*
+ * Manifest.c
+ * Author: Christian Würthner
+ * Description: Copies all file pairs listed in a manifest in one process.
+ */
+
+#include "MyCopy.h"
+
+/* One line of the manifest */
+typedef struct {
+	char *src;
+	char *dest;
+} manifest_pair_t;
+
+/* Structure shared by all jobs */
+typedef struct {
+	manifest_pair_t *pairs;
+	uint64_t pair_count;
+	uint64_t next_pair;
+	uint64_t failed_count;
+	uint64_t invalid_count;
+	copy_options_t *options;
+} manifest_t;
+
+/* Reads all pairs from the manifest file, or stdin for "-". Invalid lines are counted. Returns
+   false on errors. */
+static bool manifest_read(const char *name, manifest_t *manifest);
+
+/* Job taking the next pair until all are copied */
+static void *manifest_job(void *args_v);
+
+int copy_manifest(copy_options_t *options) {
+	/* Read the manifest */
+	manifest_t manifest;
+	memset(&manifest, 0, sizeof(manifest_t));
+	manifest.options = options;
+	if(!manifest_read(options->manifest, &manifest)) {
+		return 1;
+	}
+
+	/* Start the jobs, the current thread runs one as well. Every job keeps its buffers for
+	   all pairs it copies. */
+	uint32_t job_count = options->job_count;
+	if(job_count > manifest.pair_count) {
+		job_count = manifest.pair_count;
+	}
+	pthread_t *threads = malloc(sizeof(pthread_t) * (job_count > 0 ? job_count : 1));
+	uint32_t started = 0;
+	for(; threads != NULL && started + 1<job_count; started++) {
+		if(pthread_create(threads + started, NULL, manifest_job, (void*) &manifest) != 0) {
+			break;
+		}
+	}
+	manifest_job(&manifest);
+
+	/* Wait for all jobs */
+	for(uint32_t i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+
+	/* Free the pairs */
+	for(uint64_t i=0; i<manifest.pair_count; i++) {
+		free(manifest.pairs[i].src);
+	}
+	free(manifest.pairs);
+
+	/* Print summary, invalid lines are pairs that failed */
+	uint64_t total_count = manifest.pair_count + manifest.invalid_count;
+	uint64_t failed_count = manifest.failed_count + manifest.invalid_count;
+	printf("%" PRIu64 " of %" PRIu64 " pairs copied, %" PRIu64 " failed\n", total_count - failed_count, total_count, failed_count);
+	if(failed_count > 0) {
+		printf("ERROR: failure while copying the manifest!\n");
+		return 4;
+	}
+
+	printf("SUCCESS.\n");
+	return 0;
+}
+
+static void *manifest_job(void *args_v) {
+	manifest_t *manifest = (manifest_t*) args_v;
+
+	while(true) {
+		/* Claim the next pair */
+		uint64_t index = __atomic_fetch_add(&manifest->next_pair, 1, __ATOMIC_RELAXED);
+		if(index >= manifest->pair_count) {
+			break;
+		}
+		manifest_pair_t *pair = manifest->pairs + index;
+
+		/* Copy it and report the result in one line */
+		int64_t copied_count;
+		copy_path_t path;
+		int status = copy_pair(pair->src, pair->dest, manifest->options, &copied_count, &path);
+		if(status == 0) {
+			printf("JOB: ok \"%s\" -> \"%s\" %" PRIu64 " bytes %s\n", pair->src, pair->dest, (uint64_t) copied_count, copy_path_name(path));
+		} else {
+			printf("JOB: failed \"%s\" -> \"%s\" status %d\n", pair->src, pair->dest, status);
+			__atomic_add_fetch(&manifest->failed_count, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static bool manifest_read(const char *name, manifest_t *manifest) {
+	/* Open the manifest */
+	FILE *file = strcmp(name, "-") == 0 ? stdin : fopen(name, "r");
+	if(file == NULL) {
+		printf("ERROR: Unable to open manifest \"%s\" (%s)\n", name, strerror(errno));
+		return false;
+	}
+
+	/* Read line by line */
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	uint64_t capacity = 0, line_number = 0;
+	while((length = getline(&line, &line_size, file)) >= 0) {
+		line_number++;
+
+		/* Cut off the newline, skip empty lines and comments */
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = 0;
+		}
+		if(length == 0 || line[0] == '#') {
+			continue;
+		}
+
+		/* The files are separated by a tab, or by a space if there is no tab */
+		char *separator = strchr(line, '\t');
+		if(separator == NULL) {
+			separator = strchr(line, ' ');
+		}
+		if(separator == NULL || separator == line || separator[1] == 0) {
+			printf("ERROR: Invalid manifest line %" PRIu64 ", expected \"src<TAB>dest\"\n", line_number);
+			manifest->invalid_count++;
+			continue;
+		}
+
+		/* Grow the list */
+		if(manifest->pair_count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			manifest_pair_t *pairs = realloc(manifest->pairs, sizeof(manifest_pair_t) * capacity);
+			if(pairs == NULL) {
+				printf("ERROR: Out of memory!\n");
+				exit(5);
+			}
+			manifest->pairs = pairs;
+		}
+
+		/* Keep the line, both names point into it */
+		manifest_pair_t *pair = manifest->pairs + manifest->pair_count++;
+		pair->src = strdup(line);
+		if(pair->src == NULL) {
+			printf("ERROR: Out of memory!\n");
+			exit(5);
+		}
+		pair->src[separator - line] = 0;
+		pair->dest = pair->src + (separator - line) + 1;
+	}
+
+	/* Close the manifest */
+	free(line);
+	if(file != stdin) {
+		fclose(file);
+	}
+
+	return true;
+}
@@ -4,61 +4,407 @@
  * Description: Simple copy program.
  */
 
-#include <stdio.h>
-#include <inttypes.h>
-#include <string.h>
-#include <errno.h>
-
-/* Size of the data blocks copied in bytes */
-#define BLOCK_SIZE 1024
+#include "MyCopy.h"
 
 int main(int argc, char const *argv[]) {
-	/* Check number of arguments and print manual */
-	if(argc < 3) {
-		printf("ERROR: Too few arguments. Usage: ./MyCopy src dest\n");
+	/* Parse arguments and print manual */
+	copy_options_t options;
+	if(!parse_options(argc, argv, &options)) {
+		return 3;
+	}
+
+	/* Start the throttle shared by all copies */
+	if(throttle_start(&options.throttle) != 0) {
+		return 3;
+	}
+
+	/* Directories are copied recursively */
+	if(options.recursive) {
+		if(progress_start(options.progress, 0, options.progress_shm_name) != 0) {
+			printf("ERROR: Unable to start progress reports (%s)\n", strerror(errno));
+			return 3;
+		}
+		int status = copy_directory(&options);
+		progress_stop();
+		return status;
+	}
+
+	/* Copy all pairs of a manifest in this process */
+	if(options.manifest != NULL) {
+		if(progress_start(options.progress, 0, options.progress_shm_name) != 0) {
+			printf("ERROR: Unable to start progress reports (%s)\n", strerror(errno));
+			return 3;
+		}
+		int status = copy_manifest(&options);
+		progress_stop();
+		return status;
+	}
+
+	/* Report the progress towards the size of the source, if it has one */
+	struct stat src_stat;
+	uint64_t total = stat(options.src, &src_stat) == 0 && S_ISREG(src_stat.st_mode) ? src_stat.st_size : 0;
+	if(progress_start(options.progress, total, options.progress_shm_name) != 0) {
+		printf("ERROR: Unable to start progress reports (%s)\n", strerror(errno));
 		return 3;
 	}
 
-	/* Open file pointer for source and handle error */
-	FILE *src = fopen(argv[1], "r");
-	if(src == NULL) {
-		printf("ERROR: Unable to open source file \"%s\" (%s)\n", argv[1], strerror(errno));
+	/* Copy with the selected mode */
+	copy_path_t path = COPY_PATH_NONE;
+	int64_t copied_count = 0;
+	int status = copy_pair(options.src, options.dest, &options, &copied_count, &path);
+	progress_stop();
+
+	/* Report how much was copied and which path was taken */
+	if(status == 0) {
+		printf("%" PRIu64 " bytes copied.\n", (uint64_t) copied_count);
+	}
+	if(path != COPY_PATH_NONE) {
+		printf("PATH: %s\n", copy_path_name(path));
+	}
+
+	/* Print success and exit */
+	if(status == 0) {
+		printf("SUCCESS.\n");
+	}
+	return status;
+}
+
+int copy_pair(const char *src_name, const char *dest_name, copy_options_t *options, int64_t *copied_count, copy_path_t *path) {
+	*copied_count = -1;
+	*path = COPY_PATH_NONE;
+
+	/* Open file descriptor for source and handle error */
+	int src = open(src_name, O_RDONLY);
+	if(src < 0) {
+		printf("ERROR: Unable to open source file \"%s\" (%s)\n", src_name, strerror(errno));
 		return 1;
 	}
 
-	/* Open file pointer for destination and handle error */
-	FILE *dest = fopen(argv[2], "w+");
-	if(dest == NULL) {
-		printf("ERROR: Unable to create destination file \"%s\" (%s)\n", argv[2], strerror(errno));
-		fclose(src);
+	/* Open file descriptor for destination and handle error, the delta mode keeps the old content */
+	int dest = open(dest_name, O_RDWR | O_CREAT | (options->mode == COPY_MODE_DELTA ? 0 : O_TRUNC), 0666);
+	if(dest < 0) {
+		printf("ERROR: Unable to create destination file \"%s\" (%s)\n", dest_name, strerror(errno));
+		close(src);
 		return 2;
 	}
 
-	/* Create buffer for efficent copying and counters */
-	uint8_t buffer[BLOCK_SIZE];
-	uint16_t read_count = 0;
-	uint64_t copied_count = 0;
+	/* Copy with the selected mode */
+	*copied_count = copy_file(src, dest, dest_name, options, path);
 
-	/* Copy blocks */
-	while((read_count = fread(buffer, 1, BLOCK_SIZE, src)) > 0) {
-		fwrite(buffer, 1, read_count, dest);
-		copied_count += read_count;
-		printf("%" PRIu64 " bytes copied...\n", copied_count);
+	/* Check if a error occured while copying */
+	if(*copied_count < 0) {
+		printf("ERROR: failure while copying the file \"%s\" (%s)!\n", src_name, strerror(errno));
+		close(src);
+		close(dest);
+		return 4;
 	}
 
-	/* Check if a error occured while reading the source file */
-	if(ferror(src)) {
-		printf("ERROR: failure while reading the source file!\n");
-		return 3;
+	/* Close files, errors of delayed writes are reported here */
+	close(src);
+	if(close(dest) != 0) {
+		printf("ERROR: failure while writing the destination file \"%s\"!\n", dest_name);
+		return 4;
 	}
 
-	/* Check if a error occured while writing the destination file */
-	if(ferror(dest)) {
-		printf("ERROR: failure while writing the destination file!\n");
+	return 0;
+}
+
+bool parse_options(int argc, char const *argv[], copy_options_t *options) {
+	/* Set defaults */
+	memset(options, 0, sizeof(copy_options_t));
+	options->mode = COPY_MODE_KERNEL;
+	options->thread_count = COPY_PARALLEL_THREADS;
+	options->chunk_size = COPY_PARALLEL_CHUNK_SIZE;
+	options->queue_depth = COPY_URING_QUEUE_DEPTH;
+	options->job_count = COPY_TREE_WORKERS;
+
+	/* Define long options */
+	static const struct option long_options[] = {
+		{"mmap", no_argument, NULL, 'm'},
+		{"parallel", no_argument, NULL, 'p'},
+		{"threads", required_argument, NULL, 't'},
+		{"chunk", required_argument, NULL, 'c'},
+		{"uring", no_argument, NULL, 'u'},
+		{"queue-depth", required_argument, NULL, 'q'},
+		{"direct", no_argument, NULL, 'd'},
+		{"sparse", no_argument, NULL, 's'},
+		{"delta", no_argument, NULL, 'D'},
+		{"reflink", optional_argument, NULL, 'l'},
+		{"recursive", no_argument, NULL, 'r'},
+		{"jobs", required_argument, NULL, 'j'},
+		{"checksum", no_argument, NULL, 'k'},
+		{"verify", no_argument, NULL, 'v'},
+		{"progress", required_argument, NULL, 'P'},
+		{"manifest", required_argument, NULL, 'M'},
+		{"bwlimit", required_argument, NULL, 'B'},
+		{"iops", required_argument, NULL, 'I'},
+		{"adaptive", no_argument, NULL, 'A'},
+		{"throttle-file", required_argument, NULL, 'T'},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Parse options, errors are printed by us */
+	opterr = 0;
+	int option;
+	uint64_t value;
+	while((option = getopt_long(argc, (char * const *) argv, "r", long_options, NULL)) != -1) {
+		switch(option) {
+			case 'm':
+				options->mode = COPY_MODE_MMAP;
+				break;
+
+			case 'p':
+				options->mode = COPY_MODE_PARALLEL;
+				break;
+
+			case 't':
+				if(!parse_size(optarg, &value) || value == 0 || value > UINT16_MAX) {
+					printf("ERROR: Invalid thread count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->thread_count = value;
+				break;
+
+			case 'c':
+				if(!parse_size(optarg, &value) || value == 0) {
+					printf("ERROR: Invalid chunk size \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->chunk_size = value;
+				break;
+
+			case 'u':
+				options->mode = COPY_MODE_URING;
+				break;
+
+			case 'q':
+				if(!parse_size(optarg, &value) || value == 0 || value > COPY_URING_MAX_QUEUE_DEPTH) {
+					printf("ERROR: Invalid queue depth \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->queue_depth = value;
+				break;
+
+			case 'd':
+				options->mode = COPY_MODE_DIRECT;
+				break;
+
+			case 's':
+				options->mode = COPY_MODE_SPARSE;
+				break;
+
+			case 'D':
+				options->mode = COPY_MODE_DELTA;
+				break;
+
+			case 'l':
+				if(optarg == NULL || strcmp(optarg, "always") == 0) {
+					options->reflink = REFLINK_ALWAYS;
+				} else if(strcmp(optarg, "auto") == 0) {
+					options->reflink = REFLINK_AUTO;
+				} else if(strcmp(optarg, "never") == 0) {
+					options->reflink = REFLINK_NEVER;
+				} else {
+					printf("ERROR: Invalid reflink mode \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'r':
+				options->recursive = true;
+				break;
+
+			case 'j':
+				if(!parse_size(optarg, &value) || value == 0 || value > UINT16_MAX) {
+					printf("ERROR: Invalid job count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->job_count = value;
+				break;
+
+			case 'k':
+				options->checksum = true;
+				break;
+
+			case 'v':
+				options->checksum = true;
+				options->verify = true;
+				break;
+
+			case 'P':
+				if(!progress_parse_mode(optarg, &options->progress, &options->progress_shm_name)) {
+					printf("ERROR: Invalid progress mode \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'M':
+				options->manifest = optarg;
+				break;
+
+			case 'B':
+				if(!parse_size(optarg, &options->throttle.byte_rate)) {
+					printf("ERROR: Invalid bandwidth limit \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'I':
+				if(!parse_size(optarg, &options->throttle.op_rate)) {
+					printf("ERROR: Invalid IOPS limit \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'A':
+				options->throttle.adaptive = true;
+				break;
+
+			case 'T':
+				options->throttle.control_file = optarg;
+				break;
+
+			default:
+				printf("ERROR: Invalid option. %s\n", USAGE);
+				return false;
+		}
+	}
+
+	/* Only the plain read/write loop can be throttled block by block */
+	if(throttle_requested(&options->throttle) && (options->mode != COPY_MODE_KERNEL || options->checksum)) {
+		printf("ERROR: Throttling can't be combined with other modes or checksums. %s\n", USAGE);
+		return false;
+	}
+
+	/* A checksum needs the data to pass through us, a reflink never moves it */
+	if(options->reflink == REFLINK_ALWAYS && options->checksum) {
+		printf("ERROR: --reflink=always can't be combined with checksums. %s\n", USAGE);
+		return false;
+	}
+
+	/* A manifest replaces the files */
+	if(options->manifest != NULL) {
+		return true;
+	}
+
+	/* Check number of remaining arguments */
+	if(argc - optind < 2) {
+		printf("ERROR: Too few arguments. %s\n", USAGE);
+		return false;
+	}
+
+	/* Set files */
+	options->src = argv[optind];
+	options->dest = argv[optind + 1];
+
+	return true;
+}
+
+int copy_directory(copy_options_t *options) {
+	/* Copy the tree */
+	tree_stats_t stats;
+	if(copy_tree(options->src, options->dest, options->job_count, options->mode != COPY_MODE_DELTA, copy_file, options, &stats) != 0) {
+		printf("ERROR: Unable to copy directory \"%s\" to \"%s\" (%s)\n", options->src, options->dest, strerror(errno));
+		return 1;
+	}
+
+	/* Print summary */
+	printf("%" PRIu64 " files with %" PRIu64 " bytes copied, %" PRIu64 " errors\n", stats.file_count, stats.copied_count, stats.error_count);
+	if(stats.error_count > 0) {
+		printf("ERROR: failure while copying the directory!\n");
 		return 4;
 	}
 
-	/* Print success and exit */
 	printf("SUCCESS.\n");
 	return 0;
-}
\ No newline at end of file
+}
+
+int64_t copy_file(int src, int dest, const char *name, void *options_v, copy_path_t *path) {
+	copy_options_t *options = (copy_options_t*) options_v;
+
+	/* Checksums need the data in user space, so the mode is ignored */
+	if(options->checksum) {
+		return copy_file_checksum(src, dest, name, options, path);
+	}
+
+	/* Try to share the extents first, in auto mode unsupported filesystems copy the data */
+	if(options->reflink != REFLINK_NEVER) {
+		int64_t copied_count = copy_reflink(src, dest, path);
+		if(copied_count >= 0 || options->reflink == REFLINK_ALWAYS || !is_fallback_error(errno)) {
+			return copied_count;
+		}
+	}
+
+	/* Throttled copies write the data block by block so every write waits for its tokens */
+	if(throttle_requested(&options->throttle)) {
+		return copy_throttled(src, dest, path);
+	}
+
+	switch(options->mode) {
+		case COPY_MODE_MMAP:
+			return copy_mmap(src, dest, path);
+
+		case COPY_MODE_PARALLEL:
+			return copy_parallel(src, dest, options->thread_count, options->chunk_size, path);
+
+		case COPY_MODE_URING:
+			return copy_uring(src, dest, options->queue_depth, path);
+
+		case COPY_MODE_DIRECT:
+			return copy_direct(src, dest, path);
+
+		case COPY_MODE_SPARSE:
+			return copy_sparse(src, dest, path);
+
+		case COPY_MODE_DELTA:
+			return copy_file_delta(src, dest, name, options, path);
+
+		default:
+			return copy_kernel(src, dest, path);
+	}
+}
+
+int64_t copy_file_checksum(int src, int dest, const char *name, copy_options_t *options, copy_path_t *path) {
+	/* Copy and compute the checksum of the source */
+	uint32_t checksum;
+	int64_t copied_count = copy_checksum(src, dest, &checksum, path);
+	if(copied_count < 0) {
+		return -1;
+	}
+
+	/* Read the destination again and compare, a mismatch fails the copy */
+	const char *state = "unverified";
+	if(options->verify) {
+		uint32_t dest_checksum;
+		if(fsync(dest) != 0 || checksum_file(dest, &dest_checksum) != copied_count) {
+			state = "mismatch";
+		} else {
+			state = dest_checksum == checksum ? "verified" : "mismatch";
+		}
+	}
+
+	/* Print the result in one line: algorithm, digest, size, state and file */
+	printf("CHECKSUM: crc32c %08" PRIx32 " %" PRIu64 " %s \"%s\"\n", checksum, (uint64_t) copied_count, state, name);
+
+	if(strcmp(state, "mismatch") == 0) {
+		errno = EIO;
+		return -1;
+	}
+
+	return copied_count;
+}
+
+int64_t copy_file_delta(int src, int dest, const char *name, copy_options_t *options, copy_path_t *path) {
+	/* Update the destination */
+	delta_stats_t stats;
+	int64_t copied_count = copy_delta(src, dest, options->thread_count, &stats, path);
+	if(copied_count < 0 || *path != COPY_PATH_DELTA) {
+		return copied_count;
+	}
+
+	/* Print how much had to be written */
+	printf("DELTA: %" PRIu64 " of %" PRIu64 " blocks changed, %" PRIu64 " of %" PRIu64 " bytes written \"%s\"\n",
+		stats.changed_count, stats.block_count, stats.written_count, (uint64_t) copied_count, name);
+
+	return copied_count;
+}
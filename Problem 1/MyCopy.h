@@ -0,0 +1,69 @@
+/*
+ * MyCopy.h
+ * Author: Christian Würthner
+ * Description: Simple copy program.
+ */
+
+#define USAGE "Usage: ./MyCopy [--mmap | --parallel [--threads=N] [--chunk=SIZE] | --uring [--queue-depth=N] | --direct | --sparse | --delta [--threads=N]] [--reflink=always|auto|never] [-r [--jobs=N]] [--checksum [--verify]] [--progress=none|tty|json|shm[:/name]] [--bwlimit=RATE] [--iops=N] [--adaptive] [--throttle-file=FILE] (src dest | --manifest=FILE [--jobs=N])"
+
+#include "CopyEngine.h"
+#include <getopt.h>
+
+/* The copy modes selectable on the command line */
+typedef enum {
+	COPY_MODE_KERNEL,
+	COPY_MODE_MMAP,
+	COPY_MODE_PARALLEL,
+	COPY_MODE_URING,
+	COPY_MODE_DIRECT,
+	COPY_MODE_SPARSE,
+	COPY_MODE_DELTA
+} copy_mode_t;
+
+/* When to use a reflink instead of copying the data */
+typedef enum {
+	REFLINK_NEVER,
+	REFLINK_AUTO,
+	REFLINK_ALWAYS
+} reflink_t;
+
+/* Options parsed from the command line */
+typedef struct {
+	copy_mode_t mode;
+	reflink_t reflink;
+	bool recursive;
+	uint32_t job_count;
+	bool checksum;
+	bool verify;
+	progress_mode_t progress;
+	const char *progress_shm_name;
+	const char *manifest;
+	throttle_options_t throttle;
+	uint32_t thread_count;
+	uint64_t chunk_size;
+	uint32_t queue_depth;
+	const char *src;
+	const char *dest;
+} copy_options_t;
+
+/* Parses the command line into options, returns false and prints an error if it is invalid */
+bool parse_options(int argc, char const *argv[], copy_options_t *options);
+
+/* Opens and copies src_name to dest_name, prints errors and returns the exit status */
+int copy_pair(const char *src_name, const char *dest_name, copy_options_t *options, int64_t *copied_count, copy_path_t *path);
+
+/* Copies all pairs listed in the manifest with up to job_count jobs at once, returns the exit status */
+int copy_manifest(copy_options_t *options);
+
+/* Copies the directory tree src to dest, returns the exit status */
+int copy_directory(copy_options_t *options);
+
+/* Copies src to dest with the mode selected in options (copy_options_t) */
+int64_t copy_file(int src, int dest, const char *name, void *options_v, copy_path_t *path);
+
+/* Copies src to dest while computing the checksum, optionally verifies the destination and
+   prints the result for name */
+int64_t copy_file_checksum(int src, int dest, const char *name, copy_options_t *options, copy_path_t *path);
+
+/* Updates dest to the content of src with the delta copy and prints the written share for name */
+int64_t copy_file_delta(int src, int dest, const char *name, copy_options_t *options, copy_path_t *path);
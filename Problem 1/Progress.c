@@ -0,0 +1,237 @@
+/*
+ * Progress.c
+ * Author: Christian Würthner
+ * Description: Rate limited progress reports of the copy engine.
+ */
+
+#include "CopyEngine.h"
+#include <time.h>
+
+/* State of the reporter */
+typedef struct {
+	progress_mode_t mode;
+	uint64_t total;
+	double start_ms;
+	bool running;
+	bool stop;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t changed;
+	progress_shm_t *shm;
+	char shm_name[PROGRESS_SHM_NAME_LENGTH];
+} progress_t;
+
+/* Counter used until a reporter is started, and without one */
+static uint64_t progress_local_counter = 0;
+uint64_t *progress_counter = &progress_local_counter;
+
+/* The reporter of this process */
+static progress_t progress = {PROGRESS_NONE, 0, 0, false, false, 0, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, ""};
+
+/* Thread printing a report every PROGRESS_INTERVAL_MS */
+static void *progress_run(void *args_v);
+
+/* Prints one report of the current state */
+static void progress_report(bool done);
+
+/* Returns the time of the monotonic clock in ms */
+static double progress_now_ms();
+
+/* Formats a byte count with a binary unit */
+static void format_size(char *text, size_t length, double bytes);
+
+bool progress_parse_mode(const char *text, progress_mode_t *mode, const char **shm_name) {
+	*shm_name = NULL;
+
+	if(strcmp(text, "none") == 0) {
+		*mode = PROGRESS_NONE;
+	} else if(strcmp(text, "tty") == 0) {
+		*mode = PROGRESS_TTY;
+	} else if(strcmp(text, "json") == 0) {
+		*mode = PROGRESS_JSON;
+	} else if(strcmp(text, "shm") == 0) {
+		*mode = PROGRESS_SHM;
+	} else if(strncmp(text, "shm:/", 5) == 0) {
+		*mode = PROGRESS_SHM;
+		*shm_name = text + 4;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+int progress_start(progress_mode_t mode, uint64_t total, const char *shm_name) {
+	progress.mode = mode;
+	progress.total = total;
+	progress.start_ms = progress_now_ms();
+	progress.stop = false;
+
+	/* Without reports the local counter is enough */
+	if(mode == PROGRESS_NONE) {
+		return 0;
+	}
+
+	/* Shared memory mode places the counter where other processes can poll it */
+	if(mode == PROGRESS_SHM) {
+		/* Use the name of the caller or one derived from our pid */
+		if(shm_name != NULL) {
+			snprintf(progress.shm_name, PROGRESS_SHM_NAME_LENGTH, "%s", shm_name);
+		} else {
+			snprintf(progress.shm_name, PROGRESS_SHM_NAME_LENGTH, "/MyCopy.%d", (int) getpid());
+		}
+
+		/* Create and map the shared counter */
+		int fd = shm_open(progress.shm_name, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if(fd < 0) {
+			return -1;
+		}
+		if(ftruncate(fd, sizeof(progress_shm_t)) != 0) {
+			close(fd);
+			shm_unlink(progress.shm_name);
+			return -1;
+		}
+		progress.shm = mmap(NULL, sizeof(progress_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if(progress.shm == MAP_FAILED) {
+			progress.shm = NULL;
+			shm_unlink(progress.shm_name);
+			return -1;
+		}
+
+		/* Fill in the header and switch the counter, the copy updates it directly */
+		progress.shm->total = total;
+		progress.shm->start_ms = progress.start_ms;
+		progress.shm->pid = getpid();
+		__atomic_store_n(&progress.shm->bytes, *progress_counter, __ATOMIC_RELAXED);
+		progress_counter = &progress.shm->bytes;
+
+		printf("PROGRESS: shared memory \"%s\"\n", progress.shm_name);
+		return 0;
+	}
+
+	/* Other modes print from a side thread, so the copy never waits for the terminal */
+	if(pthread_create(&progress.thread, NULL, progress_run, NULL) != 0) {
+		return -1;
+	}
+	progress.running = true;
+
+	return 0;
+}
+
+void progress_stop() {
+	/* Stop the reporter thread and print the final state */
+	if(progress.running) {
+		pthread_mutex_lock(&progress.mutex);
+		progress.stop = true;
+		pthread_cond_signal(&progress.changed);
+		pthread_mutex_unlock(&progress.mutex);
+		pthread_join(progress.thread, NULL);
+		progress.running = false;
+		progress_report(true);
+	}
+
+	/* Mark the shared counter as done and remove its name, pollers keep their mapping */
+	if(progress.shm != NULL) {
+		__atomic_store_n(&progress.shm->done, 1, __ATOMIC_RELEASE);
+		progress_local_counter = __atomic_load_n(&progress.shm->bytes, __ATOMIC_RELAXED);
+		progress_counter = &progress_local_counter;
+		munmap(progress.shm, sizeof(progress_shm_t));
+		shm_unlink(progress.shm_name);
+		progress.shm = NULL;
+	}
+
+	progress.mode = PROGRESS_NONE;
+}
+
+uint64_t progress_bytes() {
+	return __atomic_load_n(progress_counter, __ATOMIC_RELAXED);
+}
+
+int progress_share() {
+	/* Anonymous shared memory is inherited by children created with fork() */
+	uint64_t *counter = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if(counter == MAP_FAILED) {
+		return -1;
+	}
+
+	*counter = *progress_counter;
+	progress_counter = counter;
+	return 0;
+}
+
+void progress_detach() {
+	progress_local_counter = 0;
+	progress_counter = &progress_local_counter;
+	progress.running = false;
+	progress.shm = NULL;
+}
+
+static void *progress_run(void *args_v) {
+	pthread_mutex_lock(&progress.mutex);
+
+	while(!progress.stop) {
+		/* Sleep for one interval or until stopped */
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_nsec += (PROGRESS_INTERVAL_MS % 1000) * 1000000L;
+		until.tv_sec += PROGRESS_INTERVAL_MS / 1000 + until.tv_nsec / 1000000000L;
+		until.tv_nsec %= 1000000000L;
+		pthread_cond_timedwait(&progress.changed, &progress.mutex, &until);
+
+		/* Print a report */
+		if(!progress.stop) {
+			progress_report(false);
+		}
+	}
+
+	pthread_mutex_unlock(&progress.mutex);
+	return NULL;
+}
+
+static void progress_report(bool done) {
+	/* Sample the counter and calculate the average rate and the remaining time */
+	uint64_t bytes = progress_bytes();
+	double elapsed = (progress_now_ms() - progress.start_ms) / 1000.;
+	double rate = elapsed > 0 ? bytes / elapsed : 0;
+	double eta = progress.total > bytes && rate > 0 ? (progress.total - bytes) / rate : 0;
+
+	/* One JSON object per line */
+	if(progress.mode == PROGRESS_JSON) {
+		printf("{\"bytes\":%" PRIu64 ",\"total\":%" PRIu64 ",\"elapsed\":%.3f,\"rate\":%.0f,\"eta\":%.3f,\"done\":%s}\n",
+			bytes, progress.total, elapsed, rate, eta, done ? "true" : "false");
+	}
+
+	/* One line which is overwritten by the next report */
+	else if(progress.mode == PROGRESS_TTY) {
+		char bytes_text[32], rate_text[32];
+		format_size(bytes_text, sizeof(bytes_text), bytes);
+		format_size(rate_text, sizeof(rate_text), rate);
+		if(progress.total > 0) {
+			printf("\r%s copied (%5.1f%%), %s/s, ETA %.0fs   ", bytes_text, 100. * bytes / progress.total, rate_text, eta);
+		} else {
+			printf("\r%s copied, %s/s   ", bytes_text, rate_text);
+		}
+		if(done) {
+			printf("\n");
+		}
+	}
+
+	fflush(stdout);
+}
+
+static double progress_now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
+static void format_size(char *text, size_t length, double bytes) {
+	const char *units[] = {"B", "KiB", "MiB", "GiB", "TiB"};
+	uint8_t unit = 0;
+	while(bytes >= 1024 && unit < 4) {
+		bytes /= 1024;
+		unit++;
+	}
+	snprintf(text, length, "%.1f %s", bytes, units[unit]);
+}
@@ -0,0 +1,333 @@
+/*
+ * Throttle.c
+ * Author: Christian Würthner
+ * Description: Token bucket limiting the bandwidth and write rate of the copies.
+ */
+
+#include "CopyEngine.h"
+#include <time.h>
+#include <signal.h>
+
+/* State of the throttle, shared by all threads of the process */
+typedef struct {
+	bool active;
+	pthread_mutex_t mutex;
+	throttle_options_t options;
+
+	/* Token buckets, they may go negative when a caller takes more than there is */
+	double byte_tokens;
+	double op_tokens;
+	double refill_ms;
+
+	/* Control file and when it was checked last */
+	struct timespec control_mtime;
+	double control_check_ms;
+
+	/* Adaptive backoff, adaptive_rate is 0 while it doesn't limit */
+	double latency_ms;
+	double baseline_ms;
+	double adaptive_rate;
+	double window_ms;
+	uint64_t window_bytes;
+} throttle_t;
+
+/* The throttle of this process */
+static throttle_t throttle = {false, PTHREAD_MUTEX_INITIALIZER};
+
+/* Signals received, handled by the next write. The scale counts SIGUSR2 up and SIGUSR1 down. */
+static int throttle_reload = 0;
+static int throttle_scale = 0;
+
+/* Records the signal, the limits are changed outside of the handler */
+static void throttle_signal_handler(int signal);
+
+/* Reads the limits from the control file, returns -1 if it can't be read or is invalid */
+static int throttle_load(const char *name);
+
+/* Applies signals and changes of the control file, called with the mutex locked */
+static void throttle_update(double now_ms);
+
+/* Adjusts the adaptive rate to the latency of the last write, called with the mutex locked */
+static void throttle_adapt(double now_ms, uint64_t count, double latency_ms);
+
+/* Returns the byte rate currently enforced, 0 if unlimited */
+static double throttle_byte_rate();
+
+/* Prints the limits currently enforced */
+static void throttle_report(const char *reason);
+
+/* Returns the time of the monotonic clock in ms */
+static double throttle_now_ms();
+
+bool throttle_requested(const throttle_options_t *options) {
+	return options->byte_rate > 0 || options->op_rate > 0 || options->adaptive || options->control_file != NULL;
+}
+
+int throttle_start(const throttle_options_t *options) {
+	if(!throttle_requested(options)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&throttle.mutex);
+	throttle.options = *options;
+
+	/* Limits in the control file replace the ones of the command line */
+	if(options->control_file != NULL && throttle_load(options->control_file) != 0) {
+		pthread_mutex_unlock(&throttle.mutex);
+		return -1;
+	}
+
+	/* Start with empty buckets so the first writes are already limited */
+	throttle.refill_ms = throttle.window_ms = throttle.control_check_ms = throttle_now_ms();
+	throttle.byte_tokens = throttle.op_tokens = 0;
+	throttle.baseline_ms = throttle.latency_ms = 0;
+	throttle.adaptive_rate = 0;
+	throttle.window_bytes = 0;
+	throttle.active = true;
+	pthread_mutex_unlock(&throttle.mutex);
+
+	/* SIGHUP reloads the control file, SIGUSR1 halves and SIGUSR2 doubles the limits */
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = throttle_signal_handler;
+	action.sa_flags = SA_RESTART;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGHUP, &action, NULL);
+	sigaction(SIGUSR1, &action, NULL);
+	sigaction(SIGUSR2, &action, NULL);
+
+	throttle_report("start");
+	return 0;
+}
+
+int write_throttled(int fd, const uint8_t *buffer, size_t count) {
+	if(!throttle.active) {
+		return write_all(fd, buffer, count);
+	}
+
+	/* Refill the buckets and take what this write needs */
+	pthread_mutex_lock(&throttle.mutex);
+	double now_ms = throttle_now_ms();
+	throttle_update(now_ms);
+	double elapsed = (now_ms - throttle.refill_ms) / 1000.;
+	throttle.refill_ms = now_ms;
+	double wait = 0;
+
+	double byte_rate = throttle_byte_rate();
+	if(byte_rate > 0) {
+		throttle.byte_tokens += elapsed * byte_rate;
+		if(throttle.byte_tokens > byte_rate * THROTTLE_BURST_MS / 1000.) {
+			throttle.byte_tokens = byte_rate * THROTTLE_BURST_MS / 1000.;
+		}
+		throttle.byte_tokens -= count;
+		if(throttle.byte_tokens < 0) {
+			wait = -throttle.byte_tokens / byte_rate;
+		}
+	}
+
+	double op_rate = throttle.options.op_rate;
+	if(op_rate > 0) {
+		throttle.op_tokens += elapsed * op_rate;
+		if(throttle.op_tokens > op_rate * THROTTLE_BURST_MS / 1000.) {
+			throttle.op_tokens = op_rate * THROTTLE_BURST_MS / 1000.;
+		}
+		throttle.op_tokens -= 1;
+		if(throttle.op_tokens < 0 && -throttle.op_tokens / op_rate > wait) {
+			wait = -throttle.op_tokens / op_rate;
+		}
+	}
+	pthread_mutex_unlock(&throttle.mutex);
+
+	/* Sleep until the debt is paid, the tokens are already taken so other threads queue up
+	   behind us without holding the mutex */
+	if(wait > 0) {
+		struct timespec duration = {(time_t) wait, (long) ((wait - (time_t) wait) * 1e9)};
+		while(nanosleep(&duration, &duration) != 0 && errno == EINTR);
+	}
+
+	/* Write and measure how long the kernel took to accept the data */
+	double start_ms = throttle_now_ms();
+	if(write_all(fd, buffer, count) != 0) {
+		return -1;
+	}
+	double end_ms = throttle_now_ms();
+
+	if(throttle.options.adaptive) {
+		pthread_mutex_lock(&throttle.mutex);
+		throttle_adapt(end_ms, count, end_ms - start_ms);
+		pthread_mutex_unlock(&throttle.mutex);
+	}
+
+	return 0;
+}
+
+int64_t copy_throttled(int src, int dest, copy_path_t *path) {
+	*path = COPY_PATH_THROTTLED;
+
+	/* Use the buffer of this thread */
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+
+	/* Copy blocks, each write takes its tokens */
+	uint64_t copied_count = 0;
+	ssize_t read_count = 0;
+	while((read_count = read(src, buffer, THROTTLE_BLOCK_SIZE)) != 0) {
+		/* Retry if interrupted, cancel on errors */
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if(write_throttled(dest, buffer, read_count) != 0) {
+			return -1;
+		}
+
+		copied_count += read_count;
+		progress_add(read_count);
+	}
+
+	return copied_count;
+}
+
+static void throttle_signal_handler(int signal) {
+	if(signal == SIGHUP) {
+		__atomic_store_n(&throttle_reload, 1, __ATOMIC_RELAXED);
+	} else {
+		__atomic_add_fetch(&throttle_scale, signal == SIGUSR2 ? 1 : -1, __ATOMIC_RELAXED);
+	}
+}
+
+static int throttle_load(const char *name) {
+	/* Read the whole file, it only holds a few words */
+	FILE *file = fopen(name, "r");
+	if(file == NULL) {
+		printf("ERROR: Unable to open throttle control file \"%s\" (%s)\n", name, strerror(errno));
+		return -1;
+	}
+	struct stat file_stat;
+	if(fstat(fileno(file), &file_stat) == 0) {
+		throttle.control_mtime = file_stat.st_mtim;
+	}
+
+	/* Parse words like "bytes=10M ops=500 adaptive=on", missing keys keep their value */
+	throttle_options_t options = throttle.options;
+	char word[64];
+	bool valid = true;
+	while(valid && fscanf(file, "%63s", word) == 1) {
+		if(word[0] == '#') {
+			/* Comments run to the end of their line */
+			int c;
+			while((c = fgetc(file)) != EOF && c != '\n');
+		} else if(strncmp(word, "bytes=", 6) == 0) {
+			valid = parse_size(word + 6, &options.byte_rate);
+		} else if(strncmp(word, "ops=", 4) == 0) {
+			valid = parse_size(word + 4, &options.op_rate);
+		} else if(strcmp(word, "adaptive=on") == 0) {
+			options.adaptive = true;
+		} else if(strcmp(word, "adaptive=off") == 0) {
+			options.adaptive = false;
+		} else {
+			valid = false;
+		}
+	}
+	fclose(file);
+
+	if(!valid) {
+		printf("ERROR: Invalid word \"%s\" in throttle control file \"%s\"\n", word, name);
+		return -1;
+	}
+
+	throttle.options = options;
+	return 0;
+}
+
+static void throttle_update(double now_ms) {
+	/* Apply the signals received since the last write */
+	if(__atomic_exchange_n(&throttle_reload, 0, __ATOMIC_RELAXED) && throttle.options.control_file != NULL) {
+		if(throttle_load(throttle.options.control_file) == 0) {
+			throttle_report("reload");
+		}
+	}
+	int scale = __atomic_exchange_n(&throttle_scale, 0, __ATOMIC_RELAXED);
+	for(; scale > 0; scale--) {
+		throttle.options.byte_rate *= 2;
+		throttle.options.op_rate *= 2;
+		throttle_report("faster");
+	}
+	for(; scale < 0; scale++) {
+		throttle.options.byte_rate = throttle.options.byte_rate > 1 ? throttle.options.byte_rate / 2 : throttle.options.byte_rate;
+		throttle.options.op_rate = throttle.options.op_rate > 1 ? throttle.options.op_rate / 2 : throttle.options.op_rate;
+		throttle_report("slower");
+	}
+
+	/* Reload the control file when it was changed, checked at most once per interval */
+	if(throttle.options.control_file != NULL && now_ms - throttle.control_check_ms >= THROTTLE_CONTROL_INTERVAL_MS) {
+		throttle.control_check_ms = now_ms;
+		struct stat file_stat;
+		if(stat(throttle.options.control_file, &file_stat) == 0 &&
+			(file_stat.st_mtim.tv_sec != throttle.control_mtime.tv_sec || file_stat.st_mtim.tv_nsec != throttle.control_mtime.tv_nsec)) {
+			if(throttle_load(throttle.options.control_file) == 0) {
+				throttle_report("reload");
+			}
+		}
+	}
+}
+
+static void throttle_adapt(double now_ms, uint64_t count, double latency_ms) {
+	/* Smooth the latency and remember the lowest smoothed value as the latency of an idle
+	   device, it slowly drifts up so a permanent change becomes the new normal */
+	throttle.latency_ms = throttle.latency_ms > 0 ? throttle.latency_ms * 0.8 + latency_ms * 0.2 : latency_ms;
+	if(throttle.baseline_ms == 0 || throttle.latency_ms < throttle.baseline_ms) {
+		throttle.baseline_ms = throttle.latency_ms;
+	} else {
+		throttle.baseline_ms *= 1.001;
+	}
+	throttle.window_bytes += count;
+
+	/* Adjust the rate once per window */
+	double window = (now_ms - throttle.window_ms) / 1000.;
+	if(window * 1000. < THROTTLE_ADAPT_INTERVAL_MS) {
+		return;
+	}
+	double window_rate = throttle.window_bytes / window;
+	throttle.window_ms = now_ms;
+	throttle.window_bytes = 0;
+
+	/* Back off multiplicatively while the latency is raised, starting from what we achieved */
+	if(throttle.latency_ms > throttle.baseline_ms * THROTTLE_LATENCY_FACTOR) {
+		double rate = throttle.adaptive_rate > 0 && throttle.adaptive_rate < window_rate ? throttle.adaptive_rate : window_rate;
+		throttle.adaptive_rate = rate * 0.7 > THROTTLE_MIN_RATE ? rate * 0.7 : THROTTLE_MIN_RATE;
+	}
+
+	/* Otherwise grow again until the configured limit is reached or we are no longer the limit */
+	else if(throttle.adaptive_rate > 0) {
+		throttle.adaptive_rate *= 1.1;
+		if((throttle.options.byte_rate > 0 && throttle.adaptive_rate >= throttle.options.byte_rate) ||
+			(throttle.options.byte_rate == 0 && throttle.adaptive_rate > window_rate * 2)) {
+			throttle.adaptive_rate = 0;
+		}
+	}
+}
+
+static double throttle_byte_rate() {
+	double rate = throttle.options.byte_rate;
+	if(throttle.options.adaptive && throttle.adaptive_rate > 0 && (rate == 0 || throttle.adaptive_rate < rate)) {
+		rate = throttle.adaptive_rate;
+	}
+	return rate;
+}
+
+static void throttle_report(const char *reason) {
+	printf("THROTTLE: %s, %" PRIu64 " bytes/s, %" PRIu64 " ops/s, adaptive %s (0 is unlimited)\n", reason,
+		throttle.options.byte_rate, throttle.options.op_rate, throttle.options.adaptive ? "on" : "off");
+}
+
+static double throttle_now_ms() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000. + now.tv_nsec / 1000000.;
+}
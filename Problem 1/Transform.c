@@ -0,0 +1,352 @@
+/*
+ * Transform.c
+ * Author: Christian Würthner
+ * Description: Stream transforms for the PipeCopy stages and a small LZ compressor.
+ */
+
+#include "CopyEngine.h"
+
+/* Every compressed stream starts with this magic */
+#define LZ_MAGIC "MCLZ"
+#define LZ_MAGIC_LENGTH 4
+
+/* Size of the block header, the raw and the stored length as little endian 32 bit values */
+#define LZ_HEADER_SIZE 8
+
+/* Shortest match, the bits of the hash table and the literals always left at the end of a block */
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 14
+#define LZ_LAST_LITERALS 5
+
+/* Maximum compressed size of length bytes */
+#define LZ_BOUND(length) ((length) + (length) / 255 + 16)
+
+/* Applies one transform to a buffer of data */
+static int transform_block(int dest, transform_t transform, const uint8_t *data, size_t length, uint8_t *out, transform_result_t *result);
+
+/* Reads the compressed stream of src and writes the data to dest */
+static int64_t transform_decompress(int src, int dest, uint8_t *buffer, uint8_t *out, transform_result_t *result);
+
+/* Reads until count bytes are read or the end of the file, returns the bytes read or -1 */
+static ssize_t read_full(int fd, uint8_t *buffer, size_t count);
+
+/* Compresses length bytes of src to dest, which holds LZ_BOUND(length) bytes. Returns the size. */
+static size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dest);
+
+/* Decompresses length bytes of src to dest, which holds capacity bytes. Returns the size or -1. */
+static int64_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dest, size_t capacity);
+
+/* Writes one sequence of literals followed by a match, match_length 0 ends the block */
+static uint8_t *lz_sequence(uint8_t *out, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length);
+
+/* Writes the part of a length that doesn't fit the token */
+static uint8_t *lz_write_length(uint8_t *out, size_t length);
+
+/* Stores and loads little endian 32 bit values */
+static void store32(uint8_t *data, uint32_t value);
+static uint32_t load32(const uint8_t *data);
+
+bool transform_parse(const char *text, transform_t *transform) {
+	if(strcmp(text, "crc32c") == 0) {
+		*transform = TRANSFORM_CRC32C;
+	} else if(strcmp(text, "count") == 0) {
+		*transform = TRANSFORM_COUNT;
+	} else if(strcmp(text, "compress") == 0) {
+		*transform = TRANSFORM_COMPRESS;
+	} else if(strcmp(text, "decompress") == 0) {
+		*transform = TRANSFORM_DECOMPRESS;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+const char *transform_name(transform_t transform) {
+	switch(transform) {
+		case TRANSFORM_CRC32C: return "crc32c";
+		case TRANSFORM_COUNT: return "count";
+		case TRANSFORM_COMPRESS: return "compress";
+		case TRANSFORM_DECOMPRESS: return "decompress";
+		default: return "none";
+	}
+}
+
+int64_t transform_stream(int src, int dest, transform_t transform, transform_result_t *result) {
+	memset(result, 0, sizeof(transform_result_t));
+
+	/* Read whole blocks into the buffer of this thread, compressed blocks go to a second one */
+	uint8_t *buffer = copy_buffer();
+	uint8_t *out = malloc(LZ_BOUND(COPY_LZ_BLOCK_SIZE) + LZ_HEADER_SIZE);
+	if(buffer == NULL || out == NULL) {
+		free(out);
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* Decompression reads blocks of the sizes in their headers */
+	if(transform == TRANSFORM_DECOMPRESS) {
+		int64_t written_count = transform_decompress(src, dest, buffer, out, result);
+		free(out);
+		return written_count;
+	}
+
+	/* A compressed stream starts with the magic */
+	if(transform == TRANSFORM_COMPRESS) {
+		if(write_all(dest, (const uint8_t*) LZ_MAGIC, LZ_MAGIC_LENGTH) != 0) {
+			free(out);
+			return -1;
+		}
+		result->out_count += LZ_MAGIC_LENGTH;
+	}
+
+	/* Transform block by block */
+	ssize_t read_count;
+	while((read_count = read_full(src, buffer, COPY_LZ_BLOCK_SIZE)) > 0) {
+		result->in_count += read_count;
+		if(transform_block(dest, transform, buffer, read_count, out, result) != 0) {
+			read_count = -1;
+			break;
+		}
+	}
+
+	free(out);
+	return read_count < 0 ? -1 : (int64_t) result->out_count;
+}
+
+static int transform_block(int dest, transform_t transform, const uint8_t *data, size_t length, uint8_t *out, transform_result_t *result) {
+	/* Compressed blocks are stored raw if compression doesn't help, the decompressor tells them
+	   apart by the equal lengths in the header */
+	if(transform == TRANSFORM_COMPRESS) {
+		size_t stored_length = lz_compress(data, length, out + LZ_HEADER_SIZE);
+		if(stored_length >= length) {
+			stored_length = length;
+			memcpy(out + LZ_HEADER_SIZE, data, length);
+		}
+		store32(out, length);
+		store32(out + 4, stored_length);
+		result->out_count += LZ_HEADER_SIZE + stored_length;
+		return write_all(dest, out, LZ_HEADER_SIZE + stored_length);
+	}
+
+	/* The other transforms only look at the data */
+	if(transform == TRANSFORM_CRC32C) {
+		result->checksum = crc32c(result->checksum, data, length);
+	}
+	result->out_count += length;
+	return write_all(dest, data, length);
+}
+
+static int64_t transform_decompress(int src, int dest, uint8_t *buffer, uint8_t *out, transform_result_t *result) {
+	/* Check the magic */
+	uint8_t magic[LZ_MAGIC_LENGTH];
+	ssize_t read_count = read_full(src, magic, LZ_MAGIC_LENGTH);
+	if(read_count < 0) {
+		return -1;
+	}
+	if(read_count == 0) {
+		return 0;
+	}
+	if(read_count != LZ_MAGIC_LENGTH || memcmp(magic, LZ_MAGIC, LZ_MAGIC_LENGTH) != 0) {
+		errno = EILSEQ;
+		return -1;
+	}
+	result->in_count += LZ_MAGIC_LENGTH;
+
+	uint8_t header[LZ_HEADER_SIZE];
+	while((read_count = read_full(src, header, LZ_HEADER_SIZE)) > 0) {
+		/* Check the header, the block must fit our buffers */
+		uint32_t length = load32(header);
+		uint32_t stored_length = load32(header + 4);
+		if(read_count != LZ_HEADER_SIZE || length > COPY_LZ_BLOCK_SIZE || stored_length > length) {
+			errno = EILSEQ;
+			return -1;
+		}
+
+		/* Read the stored block */
+		if(read_full(src, out, stored_length) != (ssize_t) stored_length) {
+			errno = errno != 0 ? errno : EILSEQ;
+			return -1;
+		}
+		result->in_count += LZ_HEADER_SIZE + stored_length;
+
+		/* Raw blocks are written as they are */
+		const uint8_t *data = out;
+		if(stored_length < length) {
+			if(lz_decompress(out, stored_length, buffer, length) != (int64_t) length) {
+				errno = EILSEQ;
+				return -1;
+			}
+			data = buffer;
+		}
+		if(write_all(dest, data, length) != 0) {
+			return -1;
+		}
+		result->out_count += length;
+	}
+
+	return read_count < 0 ? -1 : (int64_t) result->out_count;
+}
+
+static ssize_t read_full(int fd, uint8_t *buffer, size_t count) {
+	errno = 0;
+	size_t read_count = 0;
+	while(read_count < count) {
+		ssize_t done = read(fd, buffer + read_count, count - read_count);
+		if(done < 0 && errno == EINTR) {
+			continue;
+		}
+		if(done < 0) {
+			return -1;
+		}
+		if(done == 0) {
+			break;
+		}
+		read_count += done;
+	}
+
+	return read_count;
+}
+
+static size_t lz_compress(const uint8_t *src, size_t length, uint8_t *dest) {
+	/* Positions of the last occurrence of every hashed 4 byte sequence */
+	static __thread uint32_t table[1 << LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+
+	uint8_t *out = dest;
+	size_t position = 0, anchor = 0;
+	while(position + LZ_MIN_MATCH + LZ_LAST_LITERALS <= length) {
+		/* Look up the last position of the next 4 bytes */
+		uint32_t value;
+		memcpy(&value, src + position, sizeof(value));
+		uint32_t hash = (value * 2654435761u) >> (32 - LZ_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = position;
+
+		/* No match, try the next position */
+		uint32_t candidate_value;
+		memcpy(&candidate_value, src + candidate, sizeof(candidate_value));
+		if(candidate >= position || position - candidate > UINT16_MAX || candidate_value != value) {
+			position++;
+			continue;
+		}
+
+		/* Extend the match, the last literals stay literals */
+		size_t match_length = LZ_MIN_MATCH;
+		while(position + match_length < length - LZ_LAST_LITERALS && src[candidate + match_length] == src[position + match_length]) {
+			match_length++;
+		}
+
+		out = lz_sequence(out, src + anchor, position - anchor, position - candidate, match_length);
+		position += match_length;
+		anchor = position;
+	}
+
+	/* The rest are literals */
+	out = lz_sequence(out, src + anchor, length - anchor, 0, 0);
+	return out - dest;
+}
+
+static int64_t lz_decompress(const uint8_t *src, size_t length, uint8_t *dest, size_t capacity) {
+	const uint8_t *in = src, *end = src + length;
+	size_t produced = 0;
+
+	while(in < end) {
+		uint8_t token = *in++;
+
+		/* Literals */
+		size_t literal_length = token >> 4;
+		if(literal_length == 15) {
+			uint8_t extra;
+			do {
+				if(in >= end) {
+					return -1;
+				}
+				extra = *in++;
+				literal_length += extra;
+			} while(extra == 255);
+		}
+		if(literal_length > (size_t) (end - in) || literal_length > capacity - produced) {
+			return -1;
+		}
+		memcpy(dest + produced, in, literal_length);
+		in += literal_length;
+		produced += literal_length;
+
+		/* The last sequence has no match */
+		if(in == end) {
+			break;
+		}
+
+		/* Match, it may overlap with the bytes it produces */
+		if(end - in < 2) {
+			return -1;
+		}
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		size_t match_length = (token & 15);
+		if(match_length == 15) {
+			uint8_t extra;
+			do {
+				if(in >= end) {
+					return -1;
+				}
+				extra = *in++;
+				match_length += extra;
+			} while(extra == 255);
+		}
+		match_length += LZ_MIN_MATCH;
+		if(offset == 0 || offset > produced || match_length > capacity - produced) {
+			return -1;
+		}
+		for(size_t i=0; i<match_length; i++, produced++) {
+			dest[produced] = dest[produced - offset];
+		}
+	}
+
+	return produced;
+}
+
+static uint8_t *lz_sequence(uint8_t *out, const uint8_t *literals, size_t literal_length, size_t offset, size_t match_length) {
+	/* The token holds both lengths up to 15 */
+	size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+	*out++ = (literal_length < 15 ? literal_length : 15) << 4 | (match_code < 15 ? match_code : 15);
+
+	/* Literals */
+	if(literal_length >= 15) {
+		out = lz_write_length(out, literal_length - 15);
+	}
+	memcpy(out, literals, literal_length);
+	out += literal_length;
+
+	/* Match */
+	if(match_length > 0) {
+		*out++ = offset & 0xFF;
+		*out++ = offset >> 8;
+		if(match_code >= 15) {
+			out = lz_write_length(out, match_code - 15);
+		}
+	}
+
+	return out;
+}
+
+static uint8_t *lz_write_length(uint8_t *out, size_t length) {
+	while(length >= 255) {
+		*out++ = 255;
+		length -= 255;
+	}
+	*out++ = length;
+	return out;
+}
+
+static void store32(uint8_t *data, uint32_t value) {
+	data[0] = value;
+	data[1] = value >> 8;
+	data[2] = value >> 16;
+	data[3] = value >> 24;
+}
+
+static uint32_t load32(const uint8_t *data) {
+	return data[0] | data[1] << 8 | data[2] << 16 | (uint32_t) data[3] << 24;
+}
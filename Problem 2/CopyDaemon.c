@@ -0,0 +1,322 @@
+/*
+ * CopyDaemon.c
+ * Author: Christian Würthner
+ * Description: Long-lived copy service, a pool of workers copies the files clients send over a
+ *              Unix domain socket.
+ */
+
+#define USAGE "Usage: ./CopyDaemon [--workers=N] [--socket=PATH]"
+
+#include "../Problem 1/CopyEngine.h"
+#include "CopyService.h"
+#include <getopt.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+/* Default and maximum number of workers, the workers are the limit of concurrent copies */
+#define DEFAULT_WORKERS 4
+#define MAX_WORKERS 256
+
+/* Connections waiting for a free worker */
+#define LISTEN_BACKLOG 128
+
+/* Options parsed from the command line */
+typedef struct {
+	uint32_t worker_count;
+	const char *socket_path;
+} daemon_options_t;
+
+/* Set by SIGTERM and SIGINT */
+static volatile sig_atomic_t stopping = 0;
+
+/* Parses the command line into options, returns false and prints an error if it is invalid */
+bool parse_options(int argc, char const *argv[], daemon_options_t *options);
+
+/* Creates the listening socket, returns it or -1 */
+int create_socket(const char *socket_path);
+
+/* Forks a worker accepting connections on the listening socket, returns its pid or -1 */
+pid_t start_worker(int listen_fd, uint32_t worker);
+
+/* Code for a worker, serves one connection after the other until the daemon stops */
+int run_worker(int listen_fd, uint32_t worker);
+
+/* Serves all requests of one connection */
+void serve_connection(int connection_fd, uint32_t worker);
+
+/* Waits until fd can be read, SIGTERM is only delivered to a worker while it waits here. Returns
+   false if the daemon stops. */
+bool wait_readable(int fd);
+
+/* Copies src to dest with the requested mode */
+int64_t copy_request(int src, int dest, copy_service_mode_t mode, copy_path_t *path);
+
+/* Records the signal to stop */
+void handle_stop(int signal);
+
+int main(int argc, char const *argv[]) {
+	/* Parse arguments and print manual */
+	daemon_options_t options;
+	if(!parse_options(argc, argv, &options)) {
+		return 3;
+	}
+
+	/* Create the socket the workers share, it doesn't block, as all workers are woken up for
+	   every connection */
+	int listen_fd = create_socket(options.socket_path);
+	if(listen_fd < 0 || fcntl(listen_fd, F_SETFL, O_NONBLOCK) != 0) {
+		printf("ERROR: Unable to listen on \"%s\" (%s)\n", options.socket_path, strerror(errno));
+		return 1;
+	}
+
+	/* Stop on SIGTERM and SIGINT, clients closing early don't kill us */
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = handle_stop;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+	sigaction(SIGINT, &action, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Pre-start the pool, every worker accepts connections on its own */
+	pid_t workers[MAX_WORKERS];
+	for(uint32_t i=0; i<options.worker_count; i++) {
+		workers[i] = start_worker(listen_fd, i);
+		if(workers[i] == 0) {
+			return run_worker(listen_fd, i);
+		}
+	}
+	printf("SUCCESS: Listening on \"%s\" with %" PRIu32 " workers.\n", options.socket_path, options.worker_count);
+	fflush(stdout);
+
+	/* Supervise the workers and replace the ones that died */
+	while(!stopping) {
+		int status;
+		pid_t done = wait(&status);
+		if(done < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		for(uint32_t i=0; i<options.worker_count; i++) {
+			if(workers[i] == done && !stopping) {
+				if(WIFSIGNALED(status)) {
+					printf("ERROR: Worker %" PRIu32 " was killed by signal %d, restarting it.\n", i, WTERMSIG(status));
+				} else {
+					printf("ERROR: Worker %" PRIu32 " finished abnormally with status %d, restarting it.\n", i, WEXITSTATUS(status));
+				}
+				fflush(stdout);
+				workers[i] = start_worker(listen_fd, i);
+				if(workers[i] == 0) {
+					return run_worker(listen_fd, i);
+				}
+			}
+		}
+	}
+
+	/* Stop the workers, copies in progress are finished by them */
+	for(uint32_t i=0; i<options.worker_count; i++) {
+		if(workers[i] > 0) {
+			kill(workers[i], SIGTERM);
+		}
+	}
+	while(wait(NULL) > 0 || errno == EINTR);
+	close(listen_fd);
+	unlink(options.socket_path);
+
+	printf("SUCCESS: Daemon stopped.\n");
+	return 0;
+}
+
+bool parse_options(int argc, char const *argv[], daemon_options_t *options) {
+	/* Set defaults */
+	memset(options, 0, sizeof(daemon_options_t));
+	options->worker_count = DEFAULT_WORKERS;
+	options->socket_path = COPY_SERVICE_SOCKET;
+
+	/* Define long options */
+	static const struct option long_options[] = {
+		{"workers", required_argument, NULL, 'w'},
+		{"socket", required_argument, NULL, 's'},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Parse options, errors are printed by us */
+	opterr = 0;
+	int option;
+	uint64_t value;
+	while((option = getopt_long(argc, (char * const *) argv, "", long_options, NULL)) != -1) {
+		switch(option) {
+			case 'w':
+				if(!parse_size(optarg, &value) || value == 0 || value > MAX_WORKERS) {
+					printf("ERROR: Invalid worker count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->worker_count = value;
+				break;
+
+			case 's':
+				options->socket_path = optarg;
+				break;
+
+			default:
+				printf("ERROR: Invalid option. %s\n", USAGE);
+				return false;
+		}
+	}
+
+	return true;
+}
+
+int create_socket(const char *socket_path) {
+	/* Message boundaries are kept, so every request is one message */
+	int listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(listen_fd < 0) {
+		return -1;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(address.sun_path)) {
+		close(listen_fd);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	/* Replace the socket of a daemon that didn't clean up, only our user may connect */
+	unlink(socket_path);
+	mode_t mask = umask(0077);
+	int result = bind(listen_fd, (struct sockaddr*) &address, sizeof(address));
+	umask(mask);
+	if(result != 0 || listen(listen_fd, LISTEN_BACKLOG) != 0) {
+		int error = errno;
+		close(listen_fd);
+		errno = error;
+		return -1;
+	}
+
+	return listen_fd;
+}
+
+pid_t start_worker(int listen_fd, uint32_t worker) {
+	pid_t pid = fork();
+	if(pid < 0) {
+		printf("ERROR: Unable to fork worker %" PRIu32 " (%s)!\n", worker, strerror(errno));
+	}
+	return pid;
+}
+
+int run_worker(int listen_fd, uint32_t worker) {
+	/* Only the daemon handles SIGINT, SIGTERM stops us after the current copy. It is blocked
+	   outside of wait_readable(), so it can't get lost between checking stopping and waiting. */
+	signal(SIGINT, SIG_IGN);
+	sigset_t blocked;
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGTERM);
+	sigprocmask(SIG_BLOCK, &blocked, NULL);
+
+	while(wait_readable(listen_fd)) {
+		/* Take the next connection, another worker may have been faster */
+		int connection_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+		if(connection_fd < 0) {
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			printf("ERROR: Worker %" PRIu32 " can't accept connections (%s)\n", worker, strerror(errno));
+			return 1;
+		}
+
+		serve_connection(connection_fd, worker);
+		close(connection_fd);
+	}
+
+	return 0;
+}
+
+void serve_connection(int connection_fd, uint32_t worker) {
+	while(true) {
+		/* Receive the next request with its descriptors */
+		copy_request_t request;
+		int fds[2] = {-1, -1};
+		uint32_t fd_count = 2;
+		if(!wait_readable(connection_fd)) {
+			return;
+		}
+		ssize_t length = receive_fds(connection_fd, &request, sizeof(request), fds, &fd_count);
+		if(length <= 0) {
+			return;
+		}
+
+		/* Copy, requests without both files or of another protocol are answered with an error */
+		copy_reply_t reply;
+		memset(&reply, 0, sizeof(reply));
+		reply.worker = worker;
+		copy_path_t path = COPY_PATH_NONE;
+		if(length != sizeof(request) || request.magic != COPY_SERVICE_MAGIC || fd_count != 2 || request.mode > COPY_SERVICE_REFLINK) {
+			reply.copied_count = -1;
+			reply.error = EBADMSG;
+		} else {
+			reply.copied_count = copy_request(fds[0], fds[1], request.mode, &path);
+			reply.error = reply.copied_count < 0 ? errno : 0;
+		}
+		snprintf(reply.path, COPY_SERVICE_PATH_LENGTH, "%s", copy_path_name(path));
+
+		/* Our copies of the descriptors are not needed anymore, errors of delayed writes are
+		   seen by the client when it closes its descriptor */
+		for(uint32_t i=0; i<fd_count; i++) {
+			close(fds[i]);
+		}
+
+		/* Report the result */
+		if(send_fds(connection_fd, &reply, sizeof(reply), NULL, 0) != 0) {
+			return;
+		}
+	}
+}
+
+bool wait_readable(int fd) {
+	/* Unblock SIGTERM only while polling */
+	sigset_t waiting;
+	sigprocmask(SIG_SETMASK, NULL, &waiting);
+	sigdelset(&waiting, SIGTERM);
+
+	/* Errors are left to the following call */
+	struct pollfd poll_fd = {fd, POLLIN, 0};
+	while(!stopping) {
+		if(ppoll(&poll_fd, 1, NULL, &waiting) >= 0 || errno != EINTR) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+int64_t copy_request(int src, int dest, copy_service_mode_t mode, copy_path_t *path) {
+	switch(mode) {
+		case COPY_SERVICE_SPARSE:
+			return copy_sparse(src, dest, path);
+
+		case COPY_SERVICE_REFLINK: {
+			/* Share the extents if the filesystem can, copy the data otherwise */
+			int64_t copied_count = copy_reflink(src, dest, path);
+			if(copied_count >= 0 || !is_fallback_error(errno)) {
+				return copied_count;
+			}
+			return copy_kernel(src, dest, path);
+		}
+
+		default:
+			return copy_kernel(src, dest, path);
+	}
+}
+
+void handle_stop(int signal) {
+	stopping = 1;
+}
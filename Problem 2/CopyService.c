@@ -0,0 +1,146 @@
+/*
+ * CopyService.c
+ * Author: Christian Würthner
+ * Description: Protocol and client of the copy daemon.
+ */
+
+#define _GNU_SOURCE
+
+#include "CopyService.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* Largest number of descriptors sent with one message */
+#define MAX_FDS 2
+
+int copy_service_connect(const char *socket_path) {
+	/* Message boundaries are kept, so every request is one message */
+	int socket_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if(socket_fd < 0) {
+		return -1;
+	}
+
+	struct sockaddr_un address;
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if(strlen(socket_path) >= sizeof(address.sun_path)) {
+		close(socket_fd);
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	strcpy(address.sun_path, socket_path);
+
+	if(connect(socket_fd, (struct sockaddr*) &address, sizeof(address)) != 0) {
+		int error = errno;
+		close(socket_fd);
+		errno = error;
+		return -1;
+	}
+
+	return socket_fd;
+}
+
+int copy_service_request(int socket_fd, int src, int dest, copy_service_mode_t mode, copy_reply_t *reply) {
+	/* Send the request with both descriptors */
+	copy_request_t request = {COPY_SERVICE_MAGIC, mode};
+	int fds[2] = {src, dest};
+	if(send_fds(socket_fd, &request, sizeof(request), fds, 2) != 0) {
+		return -1;
+	}
+
+	/* Wait for the reply */
+	uint32_t fd_count = 0;
+	ssize_t length = receive_fds(socket_fd, reply, sizeof(copy_reply_t), NULL, &fd_count);
+	if(length != sizeof(copy_reply_t)) {
+		errno = length < 0 ? errno : ECONNRESET;
+		return -1;
+	}
+	reply->path[COPY_SERVICE_PATH_LENGTH - 1] = 0;
+
+	return 0;
+}
+
+int send_fds(int socket_fd, const void *message, size_t length, const int *fds, uint32_t fd_count) {
+	struct iovec vector = {(void*) message, length};
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &vector;
+	header.msg_iovlen = 1;
+
+	/* Attach the descriptors, the kernel duplicates them into the receiver */
+	union {
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	if(fd_count > 0) {
+		header.msg_control = control.buffer;
+		header.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+		struct cmsghdr *message_header = CMSG_FIRSTHDR(&header);
+		message_header->cmsg_level = SOL_SOCKET;
+		message_header->cmsg_type = SCM_RIGHTS;
+		message_header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+		memcpy(CMSG_DATA(message_header), fds, sizeof(int) * fd_count);
+	}
+
+	/* Retry if interrupted */
+	ssize_t sent;
+	while((sent = sendmsg(socket_fd, &header, MSG_NOSIGNAL)) < 0 && errno == EINTR);
+	return sent == (ssize_t) length ? 0 : -1;
+}
+
+ssize_t receive_fds(int socket_fd, void *message, size_t length, int *fds, uint32_t *fd_count) {
+	struct iovec vector = {message, length};
+	struct msghdr header;
+	memset(&header, 0, sizeof(header));
+	header.msg_iov = &vector;
+	header.msg_iovlen = 1;
+
+	union {
+		char buffer[CMSG_SPACE(sizeof(int) * MAX_FDS)];
+		struct cmsghdr align;
+	} control;
+	header.msg_control = control.buffer;
+	header.msg_controllen = sizeof(control.buffer);
+
+	/* Retry if interrupted */
+	ssize_t received;
+	while((received = recvmsg(socket_fd, &header, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+	if(received < 0) {
+		return -1;
+	}
+
+	/* Take the descriptors, the ones we have no room for are closed */
+	uint32_t capacity = *fd_count;
+	*fd_count = 0;
+	for(struct cmsghdr *message_header = CMSG_FIRSTHDR(&header); message_header != NULL; message_header = CMSG_NXTHDR(&header, message_header)) {
+		if(message_header->cmsg_level != SOL_SOCKET || message_header->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		uint32_t count = (message_header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		int received_fds[MAX_FDS];
+		memcpy(received_fds, CMSG_DATA(message_header), sizeof(int) * (count < MAX_FDS ? count : MAX_FDS));
+		for(uint32_t i=0; i<count && i<MAX_FDS; i++) {
+			if(*fd_count < capacity && fds != NULL) {
+				fds[(*fd_count)++] = received_fds[i];
+			} else {
+				close(received_fds[i]);
+			}
+		}
+	}
+
+	/* A truncated message is an error */
+	if(header.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) {
+		for(uint32_t i=0; i<*fd_count; i++) {
+			close(fds[i]);
+		}
+		*fd_count = 0;
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	return received;
+}
@@ -0,0 +1,58 @@
+/*
+ * CopyService.h
+ * Author: Christian Würthner
+ * Description: Protocol and client of the copy daemon.
+ */
+
+#ifndef COPY_SERVICE_H
+#define COPY_SERVICE_H
+
+/* Default path of the socket of the daemon */
+#define COPY_SERVICE_SOCKET "/tmp/CopyDaemon.socket"
+
+/* Magic starting every request, it changes with the protocol */
+#define COPY_SERVICE_MAGIC 0x4D435331 /* MCS1 */
+
+/* Length of the path name in a reply */
+#define COPY_SERVICE_PATH_LENGTH 32
+
+#include <stdint.h>
+#include <sys/types.h>
+
+/* How the daemon copies */
+typedef enum {
+	COPY_SERVICE_KERNEL,
+	COPY_SERVICE_SPARSE,
+	COPY_SERVICE_REFLINK
+} copy_service_mode_t;
+
+/* Sent with the source and the destination descriptor attached (SCM_RIGHTS) */
+typedef struct {
+	uint32_t magic;
+	uint32_t mode;
+} copy_request_t;
+
+/* Sent back when the copy is done, error is an errno value or 0 */
+typedef struct {
+	int64_t copied_count;
+	int32_t error;
+	uint32_t worker;
+	char path[COPY_SERVICE_PATH_LENGTH];
+} copy_reply_t;
+
+/* Connects to the daemon listening at socket_path, returns the socket or -1 */
+int copy_service_connect(const char *socket_path);
+
+/* Lets the daemon copy everything from src to dest starting at their offsets, blocks until it
+   is done. One connection can send any number of requests. Returns 0 if the reply was received,
+   the result of the copy is in reply, or -1 if the connection failed. */
+int copy_service_request(int socket_fd, int src, int dest, copy_service_mode_t mode, copy_reply_t *reply);
+
+/* Sends the descriptors with a message over the socket, returns 0 or -1 */
+int send_fds(int socket_fd, const void *message, size_t length, const int *fds, uint32_t fd_count);
+
+/* Receives a message and up to fd_count descriptors. Returns the message length, 0 at the end of
+   the connection or -1. The number of descriptors received is stored in fd_count. */
+ssize_t receive_fds(int socket_fd, void *message, size_t length, int *fds, uint32_t *fd_count);
+
+#endif
@@ -4,24 +4,92 @@
  * Description: Use MyCopy to copy a file in a new process.
  */
 
-#define EXECLP_ERROR 42
+#define _POSIX_C_SOURCE 200809L
 
+#include "Launcher.h"
 #include <stdio.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include "CopyService.h"
+#include "Scheduler.h"
+
+#define JOBS_USAGE "Usage: ./ForkCopy --job-file=FILE [--max-running=N] [--retries=N] [--retry-delay=MS] [MyCopy options]"
+
+/* Lets the copy daemon listening at socket_path copy src to dest instead of starting MyCopy */
+int copy_with_daemon(const char *socket_path, const char *src_name, const char *dest_name);
+
+/* Copies the pairs listed in jobs_name with one MyCopy per pair, the remaining arguments are passed
+   to every MyCopy */
+int copy_jobs(const char *jobs_name, const schedule_options_t *options, int argc, char const *argv[]);
+
+/* Reads the "src<TAB>dest" lines of the jobs file into jobs and counts the invalid ones, returns the
+   number of jobs or -1 */
+int64_t read_jobs(const char *jobs_name, int argc, char const *argv[], schedule_job_t **jobs, uint64_t *invalid_count);
+
+/* Frees the jobs read by read_jobs() */
+void free_jobs(schedule_job_t *jobs, int64_t job_count);
+
+/* Parses a positive decimal number, returns false if text isn't one */
+bool parse_number(const char *text, uint32_t *value);
 
 int main(int argc, char const *argv[]) {
-	
-	/* Fork process */
-	pid_t pid = fork();
+
+	/* Our own options come first, MyCopy's follow them. Their names differ from MyCopy's, whose
+	   --jobs and --parallel are passed on. */
+	const char *jobs_name = NULL;
+	schedule_options_t schedule_options = {1, 0, 100};
+	int first = 1;
+	for(; first<argc; first++) {
+		const char *value = strchr(argv[first], '=');
+		bool valid = value != NULL;
+		if(strncmp(argv[first], "--job-file=", 11) == 0) {
+			jobs_name = value + 1;
+		} else if(strncmp(argv[first], "--max-running=", 14) == 0) {
+			valid = parse_number(value + 1, &schedule_options.parallel) && schedule_options.parallel > 0;
+		} else if(strncmp(argv[first], "--retries=", 10) == 0) {
+			valid = parse_number(value + 1, &schedule_options.retries);
+		} else if(strncmp(argv[first], "--retry-delay=", 14) == 0) {
+			valid = parse_number(value + 1, &schedule_options.retry_delay_ms);
+		} else {
+			break;
+		}
+		if(!valid) {
+			printf("ERROR: Invalid option \"%s\". %s\n", argv[first], JOBS_USAGE);
+			return 3;
+		}
+	}
+	if(jobs_name != NULL) {
+		return copy_jobs(jobs_name, &schedule_options, argc - first, argv + first);
+	}
+	if(first > 1) {
+		printf("ERROR: --max-running, --retries and --retry-delay need a jobs file. %s\n", JOBS_USAGE);
+		return 3;
+	}
+
+	/* ForkCopy --daemon[=SOCKET] src dest hands the files to a running CopyDaemon */
+	if(argc > 1 && strncmp(argv[1], "--daemon", 8) == 0 && (argv[1][8] == 0 || argv[1][8] == '=')) {
+		if(argc != 4) {
+			printf("ERROR: Invalid arguments. Usage: ./ForkCopy --daemon[=SOCKET] src dest\n");
+			return 3;
+		}
+		return copy_with_daemon(argv[1][8] == '=' ? argv[1] + 9 : COPY_SERVICE_SOCKET, argv[2], argv[3]);
+	}
+
+	/* Start MyCopy with all our arguments, posix_spawn() doesn't copy our page tables */
+	launch_options_t options = {LAUNCH_SPAWN, false};
+	pid_t pid = launch("./MyCopy", (char * const *) argv, &options);
 
 	/* Code for parent */
 	if(pid > 0) {
 		/* Wait for child */
 		int status = 0;
-		wait(&status);
+		waitpid(pid, &status, 0);
 
 		/* Query the plain exit status */
 		status = WEXITSTATUS(status);
@@ -43,17 +111,201 @@ int main(int argc, char const *argv[]) {
 
 	}
 
-	/* Code for child */
-	else if(pid == 0) {
-		execlp("./MyCopy", argv[0], argv[1], argv[2], NULL);
-		return EXECLP_ERROR;
+	/* Code for error handling, posix_spawn() reports a failed exec here */
+	else {
+		printf("ERROR: Unable to start process (%s)!\n", strerror(errno));
+
+		if(launch_exec_failed(errno)) {
+			printf("HINT: execlp() failed. Please make shure that you call ForkCopy in the bin folder and all needed programs are also in the bin folder.\n");
+			return EXECLP_ERROR;
+		}
+
+		return 1;
+	}
+
+	return 0;
+}
+
+int copy_with_daemon(const char *socket_path, const char *src_name, const char *dest_name) {
+	/* We open the files, so the daemon copies with our permissions */
+	int src = open(src_name, O_RDONLY);
+	if(src < 0) {
+		printf("ERROR: Unable to open source file \"%s\" (%s)\n", src_name, strerror(errno));
+		return 1;
+	}
+	int dest = open(dest_name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(dest < 0) {
+		printf("ERROR: Unable to open destination file \"%s\" (%s)\n", dest_name, strerror(errno));
+		close(src);
+		return 1;
+	}
+
+	/* Send both descriptors and wait for the reply */
+	copy_reply_t reply;
+	int socket_fd = copy_service_connect(socket_path);
+	if(socket_fd < 0 || copy_service_request(socket_fd, src, dest, COPY_SERVICE_KERNEL, &reply) != 0) {
+		printf("ERROR: Unable to reach the copy daemon at \"%s\" (%s)\n", socket_path, strerror(errno));
+		if(socket_fd >= 0) {
+			close(socket_fd);
+		}
+		close(src);
+		close(dest);
+		return 1;
+	}
+	close(socket_fd);
+	close(src);
+
+	/* Errors of delayed writes show up when the last descriptor is closed */
+	if(close(dest) != 0 && reply.error == 0) {
+		reply.copied_count = -1;
+		reply.error = errno;
 	}
 
-	/* Code for error handling */
-	else if(pid < 0) {
-		printf("ERROR: Unable to fork process!\n");
+	if(reply.copied_count < 0) {
+		printf("ERROR: Worker %u failed to copy (%s)\n", reply.worker, strerror(reply.error));
 		return 1;
 	}
+	printf("%llu bytes copied.\n", (unsigned long long) reply.copied_count);
+	printf("PATH: %s (worker %u)\n", reply.path, reply.worker);
+	printf("SUCCESS.\n");
+	return 0;
+}
+
+int copy_jobs(const char *jobs_name, const schedule_options_t *options, int argc, char const *argv[]) {
+	schedule_job_t *jobs;
+	uint64_t invalid_count;
+	int64_t job_count = read_jobs(jobs_name, argc, argv, &jobs, &invalid_count);
+	if(job_count < 0) {
+		return 1;
+	}
+
+	/* Run the copies, every MyCopy writes its own output */
+	uint64_t failed_count = schedule_run("./MyCopy", jobs, job_count, options);
+
+	/* Programs that can't be executed fail all jobs the same way */
+	bool exec_failed = false;
+	for(int64_t i=0; i<job_count; i++) {
+		exec_failed |= jobs[i].status == EXECLP_ERROR << 8;
+	}
+	free_jobs(jobs, job_count);
+
+	/* Print summary, invalid lines are jobs that failed */
+	uint64_t total_count = job_count + invalid_count;
+	failed_count += invalid_count;
+	printf("%" PRIu64 " of %" PRIu64 " jobs copied, %" PRIu64 " failed\n", total_count - failed_count, total_count, failed_count);
+	if(exec_failed) {
+		printf("HINT: execlp() failed. Please make shure that you call ForkCopy in the bin folder and all needed programs are also in the bin folder.\n");
+		return EXECLP_ERROR;
+	}
+	if(failed_count > 0) {
+		printf("ERROR: One or more jobs failed!\n");
+		return 4;
+	}
 
+	printf("SUCCESS: All children finished normally.\n");
 	return 0;
-}
\ No newline at end of file
+}
+
+int64_t read_jobs(const char *jobs_name, int argc, char const *argv[], schedule_job_t **jobs, uint64_t *invalid_count) {
+	/* Open the jobs file */
+	FILE *file = strcmp(jobs_name, "-") == 0 ? stdin : fopen(jobs_name, "r");
+	if(file == NULL) {
+		printf("ERROR: Unable to open jobs file \"%s\" (%s)\n", jobs_name, strerror(errno));
+		return -1;
+	}
+
+	/* Read line by line, the lines are kept for the arguments */
+	*jobs = NULL;
+	*invalid_count = 0;
+	bool failed = false;
+	char *line = NULL;
+	size_t line_size = 0;
+	ssize_t length;
+	int64_t job_count = 0, capacity = 0, line_number = 0;
+	while((length = getline(&line, &line_size, file)) >= 0) {
+		line_number++;
+
+		/* Cut off the newline, skip empty lines and comments */
+		while(length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+			line[--length] = 0;
+		}
+		if(length == 0 || line[0] == '#') {
+			continue;
+		}
+
+		/* The files are separated by a tab, or by a space if there is no tab */
+		char *separator = strchr(line, '\t');
+		if(separator == NULL) {
+			separator = strchr(line, ' ');
+		}
+		if(separator == NULL || separator == line || separator[1] == 0) {
+			printf("ERROR: Invalid jobs line %" PRId64 ", expected \"src<TAB>dest\"\n", line_number);
+			(*invalid_count)++;
+			continue;
+		}
+		*separator = 0;
+
+		/* Grow the list */
+		if(job_count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 64;
+			schedule_job_t *grown = realloc(*jobs, sizeof(schedule_job_t) * capacity);
+			if(grown == NULL) {
+				failed = true;
+				break;
+			}
+			*jobs = grown;
+		}
+
+		/* MyCopy [options] src dest, the line buffer becomes the job's */
+		schedule_job_t *job = *jobs + job_count;
+		memset(job, 0, sizeof(schedule_job_t));
+		job->argv = malloc(sizeof(char*) * (argc + 4));
+		if(job->argv == NULL) {
+			failed = true;
+			break;
+		}
+		job->argv[0] = "MyCopy";
+		memcpy(job->argv + 1, argv, sizeof(char*) * argc);
+		job->argv[argc + 1] = line;
+		job->argv[argc + 2] = separator + 1;
+		job->argv[argc + 3] = NULL;
+		job->name = line;
+		job_count++;
+		line = NULL;
+		line_size = 0;
+	}
+
+	free(line);
+	if(file != stdin) {
+		fclose(file);
+	}
+
+	/* A truncated list must not run */
+	if(failed) {
+		printf("ERROR: Unable to read jobs file (%s)\n", strerror(ENOMEM));
+		free_jobs(*jobs, job_count);
+		return -1;
+	}
+
+	return job_count;
+}
+
+void free_jobs(schedule_job_t *jobs, int64_t job_count) {
+	for(int64_t i=0; i<job_count; i++) {
+		free((char*) jobs[i].name);
+		free(jobs[i].argv);
+	}
+	free(jobs);
+}
+
+bool parse_number(const char *text, uint32_t *value) {
+	char *end;
+	errno = 0;
+	unsigned long number = strtoul(text, &end, 10);
+	if(errno != 0 || end == text || *end != 0 || text[0] == '-' || number > UINT32_MAX) {
+		return false;
+	}
+
+	*value = number;
+	return true;
+}
@@ -0,0 +1,136 @@
+/*
+ * Launcher.c
+ * Author: Christian Würthner
+ * Description: Starts programs in a child process with posix_spawn() or fork()/exec.
+ */
+
+#define _GNU_SOURCE
+
+#include "Launcher.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+/* Environment passed to the programs */
+extern char **environ;
+
+/* Starts the program with posix_spawnp(), the file actions do the redirection */
+static pid_t launch_spawn(const char *program, char *const argv[], const launch_options_t *options);
+
+/* Starts the program with fork() and execvp(), the child does the redirection */
+static pid_t launch_fork(const char *program, char *const argv[], const launch_options_t *options);
+
+pid_t launch(const char *program, char *const argv[], const launch_options_t *options) {
+	if(options->method == LAUNCH_FORK) {
+		return launch_fork(program, argv, options);
+	}
+
+	return launch_spawn(program, argv, options);
+}
+
+int launch_and_wait(const char *program, char *const argv[], const launch_options_t *options, struct rusage *usage) {
+	/* A failed exec looks like the exit of a forked child that failed to exec, a process that
+	   couldn't be created is an error of our own */
+	struct rusage child_usage;
+	memset(&child_usage, 0, sizeof(struct rusage));
+	if(usage == NULL) {
+		usage = &child_usage;
+	}
+	pid_t pid = launch(program, argv, options);
+	if(pid < 0) {
+		memset(usage, 0, sizeof(struct rusage));
+		return launch_exec_failed(errno) ? EXECLP_ERROR << 8 : -1;
+	}
+
+	/* Wait for the child, retry if interrupted */
+	int status;
+	while(wait4(pid, &status, 0, usage) < 0) {
+		if(errno != EINTR) {
+			return -1;
+		}
+	}
+
+	return status;
+}
+
+bool launch_exec_failed(int error) {
+	switch(error) {
+		case ENOENT:
+		case EACCES:
+		case ENOEXEC:
+		case ENOTDIR:
+		case ELOOP:
+		case ENAMETOOLONG:
+		case ETXTBSY:
+		case E2BIG:
+			return true;
+		default:
+			return false;
+	}
+}
+
+const char *launch_method_name(launch_method_t method) {
+	switch(method) {
+		case LAUNCH_SPAWN: return "posix_spawn";
+		case LAUNCH_FORK: return "fork+exec";
+		default: return "none";
+	}
+}
+
+static pid_t launch_spawn(const char *program, char *const argv[], const launch_options_t *options) {
+	/* Redirect stdin and stdout in the child */
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_init(&actions);
+	if(options->null_stdio) {
+		posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+		posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+	}
+
+	/* Ask for vfork semantics, newer C libraries always use them */
+	posix_spawnattr_t attributes;
+	posix_spawnattr_init(&attributes);
+#ifdef POSIX_SPAWN_USEVFORK
+	posix_spawnattr_setflags(&attributes, POSIX_SPAWN_USEVFORK);
+#endif
+
+	/* The exec errors are reported to us, not to a child we would have to wait for */
+	pid_t pid;
+	int error = posix_spawnp(&pid, program, &actions, &attributes, argv, environ);
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+	if(error != 0) {
+		errno = error;
+		return -1;
+	}
+
+	return pid;
+}
+
+static pid_t launch_fork(const char *program, char *const argv[], const launch_options_t *options) {
+	/* Fork process */
+	pid_t pid = fork();
+
+	/* Child code */
+	if(pid == 0) {
+		/* Redirect output to /dev/null/ */
+		if(options->null_stdio) {
+			int dev_null_in = open("/dev/null", O_RDONLY);
+			int dev_null_out = open("/dev/null", O_WRONLY);
+			dup2(dev_null_in, STDIN_FILENO);
+			dup2(dev_null_out, STDOUT_FILENO);
+		}
+
+		/* exec */
+		execvp(program, argv);
+
+		/* If this code is executed, execvp failed. */
+		_exit(EXECLP_ERROR);
+	}
+
+	return pid;
+}
@@ -0,0 +1,49 @@
+/*
+ * Launcher.h
+ * Author: Christian Würthner
+ * Description: Starts programs in a child process with posix_spawn() or fork()/exec.
+ */
+
+#ifndef LAUNCHER_H
+#define LAUNCHER_H
+
+/* Exit status of a child whose program couldn't be executed */
+#define EXECLP_ERROR 42
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* The ways a program can be started */
+typedef enum {
+	LAUNCH_SPAWN,
+	LAUNCH_FORK
+} launch_method_t;
+
+/* How a program is started */
+typedef struct {
+	launch_method_t method;
+	bool null_stdio;
+} launch_options_t;
+
+/* Starts program with argv, searching the PATH like execlp(). LAUNCH_SPAWN uses posix_spawnp(),
+   which shares the address space of the parent until the exec (CLONE_VFORK) instead of copying
+   its page tables, LAUNCH_FORK uses fork() and execvp(). null_stdio connects stdin and stdout of
+   the child to /dev/null. Returns the pid, or -1 with errno if the process or, for LAUNCH_SPAWN,
+   the exec failed. */
+pid_t launch(const char *program, char *const argv[], const launch_options_t *options);
+
+/* Starts program like launch() and waits for it. Returns the wait status, a program that couldn't
+   be executed finishes with EXECLP_ERROR with both methods. Returns -1 with errno if no process
+   could be created (EAGAIN, ENOMEM) or it couldn't be waited for. The resources used by the child
+   and the children it waited for are stored in usage if it isn't NULL. */
+int launch_and_wait(const char *program, char *const argv[], const launch_options_t *options, struct rusage *usage);
+
+/* Returns true if the errno of a failed launch() means the program couldn't be executed, as
+   opposed to the process not being created */
+bool launch_exec_failed(int error);
+
+/* Returns a printable name for the given method */
+const char *launch_method_name(launch_method_t method);
+
+#endif
@@ -0,0 +1,304 @@
+/*
+ * Scheduler.c
+ * Author: Christian Würthner
+ * Description: Runs many jobs as child processes, a limited number at a time.
+ */
+
+#define _GNU_SOURCE
+
+#include "Scheduler.h"
+#include "Launcher.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+/* Older C libraries don't know waitid() on pidfds */
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+/* Interval in which children are polled without pidfds */
+#define SCHEDULE_POLL_MS 10
+
+/* A running attempt */
+typedef struct {
+	pid_t pid;
+	int pidfd;
+	uint64_t job;
+	double start_ms;
+} schedule_child_t;
+
+/* State of one run */
+typedef struct {
+	const char *program;
+	schedule_job_t *jobs;
+	uint64_t job_count;
+	const schedule_options_t *options;
+
+	/* Children running now */
+	schedule_child_t *children;
+	uint32_t running;
+
+	/* Jobs never started start at next_job, failed jobs wait until their ready time */
+	uint64_t next_job;
+	uint64_t *retries;
+	double *ready_ms;
+	uint64_t retry_count;
+
+	uint64_t finished_count;
+	uint64_t failed_count;
+} schedule_t;
+
+/* Starts the next job whose time has come, returns false if there is none */
+static bool schedule_start(schedule_t *schedule);
+
+/* Waits up to timeout_ms, or forever for -1, for a child to finish and records its attempt */
+static void schedule_reap(schedule_t *schedule, int timeout_ms);
+
+/* Records the end of an attempt, the job is retried or finished */
+static void schedule_finish(schedule_t *schedule, uint64_t job, int status);
+
+/* Returns the position of the retry that is ready first, or -1 if there is none */
+static int64_t schedule_next_retry(schedule_t *schedule);
+
+/* Returns a pidfd for the child or -1 if the kernel doesn't support them */
+static int schedule_pidfd(pid_t pid);
+
+/* Returns the current time in ms */
+static double schedule_now_ms(void);
+
+uint64_t schedule_run(const char *program, schedule_job_t *jobs, uint64_t job_count, const schedule_options_t *options) {
+	schedule_t schedule;
+	memset(&schedule, 0, sizeof(schedule));
+	schedule.program = program;
+	schedule.jobs = jobs;
+	schedule.job_count = job_count;
+	schedule.options = options;
+
+	uint32_t parallel = options->parallel > 0 ? options->parallel : 1;
+	schedule.children = malloc(sizeof(schedule_child_t) * parallel);
+	schedule.retries = malloc(sizeof(uint64_t) * (job_count > 0 ? job_count : 1));
+	schedule.ready_ms = malloc(sizeof(double) * (job_count > 0 ? job_count : 1));
+	if(schedule.children == NULL || schedule.retries == NULL || schedule.ready_ms == NULL) {
+		printf("ERROR: Unable to allocate the scheduler (%s)!\n", strerror(errno));
+		free(schedule.children);
+		free(schedule.retries);
+		free(schedule.ready_ms);
+		return job_count;
+	}
+
+	while(schedule.finished_count < job_count) {
+		/* Fill the free slots */
+		while(schedule.running < parallel && schedule_start(&schedule));
+
+		/* Wake up for the next retry, or just sleep until then if nothing runs */
+		int64_t retry = schedule_next_retry(&schedule);
+		int timeout_ms = -1;
+		if(retry >= 0) {
+			double wait_ms = schedule.ready_ms[retry] - schedule_now_ms();
+			timeout_ms = wait_ms > 0 ? (int) wait_ms + 1 : 0;
+		}
+		if(schedule.running == 0) {
+			if(retry >= 0) {
+				poll(NULL, 0, timeout_ms);
+			}
+			continue;
+		}
+
+		/* Wait for the next child to finish, whichever it is */
+		schedule_reap(&schedule, timeout_ms);
+	}
+
+	free(schedule.children);
+	free(schedule.retries);
+	free(schedule.ready_ms);
+	return schedule.failed_count;
+}
+
+bool schedule_retryable(int status) {
+	/* Children that couldn't be started or were killed */
+	if(status == -1 || WIFSIGNALED(status)) {
+		return true;
+	}
+
+	/* MyCopy exits with 1 and 2 if it can't open the files and with 3 for invalid arguments,
+	   only copy errors (4) and unknown ones are worth another try */
+	int code = WEXITSTATUS(status);
+	return code != 0 && code != 1 && code != 2 && code != 3 && code != EXECLP_ERROR;
+}
+
+static bool schedule_start(schedule_t *schedule) {
+	/* Retries that are due come first, then the jobs in their order */
+	uint64_t job;
+	int64_t retry = schedule_next_retry(schedule);
+	if(retry >= 0 && schedule->ready_ms[retry] <= schedule_now_ms()) {
+		job = schedule->retries[retry];
+		schedule->retries[retry] = schedule->retries[--schedule->retry_count];
+		schedule->ready_ms[retry] = schedule->ready_ms[schedule->retry_count];
+	} else if(schedule->next_job < schedule->job_count) {
+		job = schedule->next_job++;
+	} else {
+		return false;
+	}
+
+	/* Start the child, posix_spawn() reports programs that can't be executed at once */
+	schedule_job_t *current = schedule->jobs + job;
+	current->attempts++;
+	launch_options_t launch_options = {LAUNCH_SPAWN, false};
+	double start_ms = schedule_now_ms();
+	pid_t pid = launch(schedule->program, current->argv, &launch_options);
+	if(pid < 0) {
+		current->wall_ms = 0;
+		memset(&current->usage, 0, sizeof(struct rusage));
+		schedule_finish(schedule, job, launch_exec_failed(errno) ? EXECLP_ERROR << 8 : -1);
+		return true;
+	}
+
+	schedule_child_t *child = schedule->children + schedule->running++;
+	child->pid = pid;
+	child->pidfd = schedule_pidfd(pid);
+	child->job = job;
+	child->start_ms = start_ms;
+	return true;
+}
+
+static void schedule_reap(schedule_t *schedule, int timeout_ms) {
+	/* Poll the pidfds, they become readable when their child finishes */
+	uint32_t ready = schedule->running;
+	struct pollfd fds[schedule->running];
+	bool pidfds = true;
+	for(uint32_t i=0; i<schedule->running; i++) {
+		fds[i].fd = schedule->children[i].pidfd;
+		fds[i].events = POLLIN;
+		pidfds &= fds[i].fd >= 0;
+	}
+	if(pidfds) {
+		int result = poll(fds, schedule->running, timeout_ms);
+		if(result <= 0) {
+			return;
+		}
+		for(ready=0; ready<schedule->running && fds[ready].revents == 0; ready++);
+	}
+
+	/* Reap the child with its resource usage */
+	int status = 0;
+	struct rusage usage;
+	if(ready < schedule->running) {
+		siginfo_t info;
+		memset(&info, 0, sizeof(info));
+		if(syscall(SYS_waitid, P_PIDFD, schedule->children[ready].pidfd, &info, WEXITED, &usage) != 0) {
+			return;
+		}
+		status = info.si_code == CLD_EXITED ? (info.si_status & 0xFF) << 8 :
+			info.si_status | (info.si_code == CLD_DUMPED ? 0x80 : 0);
+	} else {
+		/* Without pidfds wait4() reaps whichever child finishes first. It can't time out, so
+		   it is polled until the timeout if there is one. */
+		double deadline_ms = schedule_now_ms() + timeout_ms;
+		pid_t pid;
+		while((pid = wait4(-1, &status, timeout_ms < 0 ? 0 : WNOHANG, &usage)) == 0) {
+			double left_ms = deadline_ms - schedule_now_ms();
+			if(left_ms <= 0) {
+				return;
+			}
+			poll(NULL, 0, left_ms < SCHEDULE_POLL_MS ? (int) left_ms + 1 : SCHEDULE_POLL_MS);
+		}
+		if(pid < 0) {
+			return;
+		}
+		for(ready=0; ready<schedule->running && schedule->children[ready].pid != pid; ready++);
+		if(ready == schedule->running) {
+			return;
+		}
+	}
+
+	/* Record the attempt and free the slot */
+	schedule_child_t child = schedule->children[ready];
+	schedule->children[ready] = schedule->children[--schedule->running];
+	if(child.pidfd >= 0) {
+		close(child.pidfd);
+	}
+	schedule_job_t *job = schedule->jobs + child.job;
+	job->wall_ms = schedule_now_ms() - child.start_ms;
+	job->usage = usage;
+	schedule_finish(schedule, child.job, status);
+}
+
+static void schedule_finish(schedule_t *schedule, uint64_t job, int status) {
+	schedule_job_t *current = schedule->jobs + job;
+	current->status = status;
+
+	/* Report the attempt in one line */
+	double user_ms = current->usage.ru_utime.tv_sec * 1000. + current->usage.ru_utime.tv_usec / 1000.;
+	double sys_ms = current->usage.ru_stime.tv_sec * 1000. + current->usage.ru_stime.tv_usec / 1000.;
+	char result[64];
+	if(status == 0) {
+		result[0] = 0;
+	} else if(status == -1) {
+		snprintf(result, sizeof(result), " (%s)", strerror(errno));
+	} else if(WIFSIGNALED(status)) {
+		snprintf(result, sizeof(result), " signal %d", WTERMSIG(status));
+	} else {
+		snprintf(result, sizeof(result), " status %d", WEXITSTATUS(status));
+	}
+	printf("JOB: %s \"%s\"%s attempt %u wall %.3fms user %.3fms sys %.3fms maxrss %ldKiB", status == 0 ? "ok" : "failed",
+		current->name, result, current->attempts, current->wall_ms, user_ms, sys_ms, current->usage.ru_maxrss);
+
+	/* Start failed jobs again later, waiting twice as long after every attempt */
+	if(status != 0 && schedule_retryable(status) && current->attempts <= schedule->options->retries) {
+		double delay_ms = schedule->options->retry_delay_ms;
+		for(uint32_t i=1; i<current->attempts; i++) {
+			delay_ms *= 2;
+		}
+		schedule->retries[schedule->retry_count] = job;
+		schedule->ready_ms[schedule->retry_count++] = schedule_now_ms() + delay_ms;
+		printf(", retrying in %.0fms\n", delay_ms);
+		fflush(stdout);
+		return;
+	}
+
+	printf("\n");
+	fflush(stdout);
+	schedule->finished_count++;
+	if(status != 0) {
+		schedule->failed_count++;
+	}
+}
+
+static int64_t schedule_next_retry(schedule_t *schedule) {
+	int64_t next = -1;
+	for(uint64_t i=0; i<schedule->retry_count; i++) {
+		if(next < 0 || schedule->ready_ms[i] < schedule->ready_ms[next]) {
+			next = i;
+		}
+	}
+
+	return next;
+}
+
+static int schedule_pidfd(pid_t pid) {
+	/* Stop trying once the kernel said it doesn't know pidfds */
+#ifdef SYS_pidfd_open
+	static bool supported = true;
+	if(supported) {
+		int pidfd = syscall(SYS_pidfd_open, pid, 0);
+		if(pidfd < 0 && errno == ENOSYS) {
+			supported = false;
+		}
+		return pidfd;
+	}
+#endif
+	return -1;
+}
+
+static double schedule_now_ms(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000. + now.tv_nsec / 1000000.;
+}
@@ -0,0 +1,45 @@
+/*
+ * Scheduler.h
+ * Author: Christian Würthner
+ * Description: Runs many jobs as child processes, a limited number at a time.
+ */
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* One job, the results describe its last attempt */
+typedef struct {
+	/* Set by the caller, argv is terminated by NULL */
+	char **argv;
+	const char *name;
+
+	/* Set by the scheduler */
+	uint32_t attempts;
+	int status;
+	double wall_ms;
+	struct rusage usage;
+} schedule_job_t;
+
+/* Limits of the scheduler. A failed job is started again up to retries times, the first retry
+   waits retry_delay_ms and every further one twice as long as the one before. */
+typedef struct {
+	uint32_t parallel;
+	uint32_t retries;
+	uint32_t retry_delay_ms;
+} schedule_options_t;
+
+/* Runs program once for every job, keeping up to options->parallel children running. Children
+   are reaped in the order they finish, with pidfds if the kernel has them. A line is printed for
+   every finished attempt. Returns the number of jobs that failed in their last attempt. */
+uint64_t schedule_run(const char *program, schedule_job_t *jobs, uint64_t job_count, const schedule_options_t *options);
+
+/* Returns true if a job finishing with the given wait status may succeed when it is started
+   again. Invalid arguments, missing files and programs that can't be executed won't. */
+bool schedule_retryable(int status);
+
+#endif
@@ -1,10 +1,14 @@
 /*
  * PipeCopy.c
  * Author: Christian Würthner
- * Description: Use two processes communicating with a pipe to copy a file
+ * Description: Use two processes communicating with a pipe to copy a file, or one pair per stripe,
+ *              optionally with transform stages in between
  */
 
-#define _POSIX_SOURCE
+#define USAGE "Usage: ./PipeCopy [--uring [--queue-depth=N] | --sparse | --read-write | --ring] [--pipe-size=SIZE|max] [--stripes=K | --stage=crc32c|count|compress|decompress ...] [--progress=none|tty|json|shm[:/name]] [--bwlimit=RATE] [--iops=N] [--adaptive] [--throttle-file=FILE] src dest"
+
+#include "../Problem 1/CopyEngine.h"
+#include <getopt.h>
 #include <stdio.h>
 #include <inttypes.h>
 #include <unistd.h>
@@ -15,164 +19,524 @@
 #include <string.h>
 #include <stdbool.h>
 
-/* Size of the data blocks copied in bytes */
+/* Size of the data blocks copied by the read/write loop in bytes */
 #define BLOCK_SIZE 1024
 
-/* Declare function to copy from one file handler to an other */
-int16_t copy(int src, int dest, int pid);
+/* Options parsed from the command line */
+typedef struct {
+	bool uring;
+	bool sparse;
+	bool read_write;
+	bool ring;
+	copy_ring_t *shared_ring;
+	uint64_t pipe_size;
+	uint32_t stripe_count;
+	transform_t stages[COPY_MAX_STAGES];
+	uint32_t stage_count;
+	progress_mode_t progress;
+	const char *progress_shm_name;
+	uint32_t queue_depth;
+	throttle_options_t throttle;
+	const char *src;
+	const char *dest;
+} pipe_options_t;
+
+/* Parses the command line into options, returns false and prints an error if it is invalid */
+bool parse_options(int argc, char const *argv[], pipe_options_t *options);
+
+/* Code for a reader child, copies count bytes from offset of the source to the pipe */
+int read_file(int pipe_fd, uint64_t offset, uint64_t count, int pid, pipe_options_t *options);
+
+/* Code for a transform stage child, transforms everything from one pipe to the next */
+int transform_file(int input_fd, int output_fd, transform_t transform, int pid);
+
+/* Code for a writer child, copies everything from the pipe to offset of the destination */
+int write_file(int pipe_fd, uint64_t offset, int pid, pipe_options_t *options);
+
+/* Declare function to copy up to count bytes from one file handler to an other, returns the bytes
+   copied or -1 */
+int64_t copy(int src, int dest, uint64_t count, int pid, pipe_options_t *options);
 
 int main(int argc, char const *argv[]) {
-	/* Check number of arguments and print manual */
-	if(argc < 3) {
-		printf("ERROR: Too few arguments. Usage: ./PipeCopy src dest\n");
+	/* Parse arguments and print manual */
+	pipe_options_t options;
+	if(!parse_options(argc, argv, &options)) {
 		return 3;
 	}
 
-	/* Create ordinary pipe */
-	int fd[2];
-	if (pipe(fd)) {
-		fprintf (stderr, "ERROR: Pipe creation failed.\n");
-		return 1;
+	/* Create the shared ring before forking, so both children map it */
+	if(options.ring) {
+		options.shared_ring = ring_create(COPY_RING_SLOT_COUNT, COPY_RING_SLOT_SIZE);
+		if(options.shared_ring == NULL) {
+			fprintf(stderr, "ERROR: Ring creation failed (%s).\n", strerror(errno));
+			return 1;
+		}
 	}
 
-	/* Fork process */
-	pid_t child_1 = fork();
-	pid_t child_2 = 0;
+	/* Stripes need a regular source to split */
+	struct stat src_stat;
+	bool src_regular = stat(options.src, &src_stat) == 0 && S_ISREG(src_stat.st_mode);
+	uint64_t total = src_regular ? src_stat.st_size : 0;
+	if(options.stripe_count > 1 && !src_regular) {
+		printf("ERROR: Stripes need a regular source file. %s\n", USAGE);
+		return 3;
+	}
 
-	/* Code for parent after forking child 1 */
-	if(child_1 > 0) {
-		/* Fork process again */
-		child_2 = fork();
+	/* Files reporting no size (like in /proc) are read as one stream. Small ones get fewer
+	   stripes, only as many as the rounded up stripe size needs, so none starts past the end. */
+	if(options.stripe_count > total) {
+		options.stripe_count = total > 0 ? total : 1;
+	}
+	uint64_t stripe_size = (total + options.stripe_count - 1) / options.stripe_count;
+	if(options.stripe_count > 1) {
+		options.stripe_count = (total + stripe_size - 1) / stripe_size;
 	}
 
-	/* Code for parent after forking child 2 */
-	if(child_2 > 0) {
-		/* Close both ends of the pipe for parent */
-		close(fd[0]);
-		close(fd[1]);
+	/* The writers of stripes share the destination, so it is created with its final size here */
+	if(options.stripe_count > 1) {
+		int dest = open(options.dest, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+		if(dest < 0 || ftruncate(dest, total) != 0) {
+			printf("ERROR: Unable to create destination file \"%s\" (%s)\n", options.dest, strerror(errno));
+			return 1;
+		}
+		close(dest);
+	}
 
-		/* Wait for both childs to finish */
-		bool error = false;
-		for(uint8_t i=0; i<2; i++) {
-			/* Wait for one child to terminate */
-			int status;
-			pid_t done = wait(&status);
+	/* The parent reports the progress, the writers count into shared memory */
+	if(options.progress != PROGRESS_NONE && (progress_share() != 0 || progress_start(options.progress, total, options.progress_shm_name) != 0)) {
+		printf("ERROR: Unable to start progress reports (%s)\n", strerror(errno));
+	}
 
-			/* Query the plain exit status */
-			status = WEXITSTATUS(status);
+	/* Nothing buffered may be printed again by the children */
+	fflush(stdout);
 
-			/* Check which child is done */
-			uint8_t child_number = 0;
-			if(child_1 == done) {
-				child_number = 1;
-			} else {
-				child_number = 2;
+	/* Fork a reader, the transform stages and a writer for every stripe */
+	uint32_t pipeline_length = options.stage_count + 2;
+	pid_t *children = calloc(options.stripe_count * pipeline_length, sizeof(pid_t));
+	if(children == NULL) {
+		fprintf(stderr, "ERROR: Out of memory.\n");
+		return 1;
+	}
+	uint32_t child_count = 0;
+	bool error = false;
+	for(uint32_t stripe=0; stripe<options.stripe_count && !error; stripe++) {
+		/* The range of this stripe, a single stripe copies the whole stream */
+		uint64_t offset = options.stripe_count > 1 ? stripe * stripe_size : 0;
+		uint64_t count = options.stripe_count > 1 ? (total - offset < stripe_size ? total - offset : stripe_size) : UINT64_MAX;
+
+		/* Every child reads the pipe of the one before it */
+		int input = -1;
+		for(uint32_t stage=0; stage<pipeline_length; stage++) {
+			/* Create ordinary pipe to the next child, the ring replaces it */
+			bool last = stage == pipeline_length - 1;
+			int fd[2] = {-1, -1};
+			if(!last && !options.ring) {
+				if (pipe(fd)) {
+					fprintf (stderr, "ERROR: Pipe creation failed.\n");
+					error = true;
+					break;
+				}
+
+				/* Make it large enough to keep both children busy */
+				int pipe_size = pipe_set_size(fd[1], options.pipe_size);
+				if(stripe == 0 && stage == 0) {
+					printf(pipe_size < 0 ? "PIPE: default size\n" : "PIPE: %d bytes\n", pipe_size);
+					fflush(stdout);
+				}
 			}
 
-			/* If the status is ok, print successull text */
-			if(status == 0) {
-				printf("SUCCESS: Child %d finished normally.\n", child_number);
-			} 
+			/* Fork the child, only the writer counts for the progress */
+			children[child_count] = fork();
+			if(children[child_count] == 0) {
+				if(!last) {
+					close(fd[0]);
+					progress_detach();
+				}
+				if(stage == 0) {
+					return read_file(fd[1], offset, count, child_count + 1, &options);
+				}
+				if(last) {
+					return write_file(input, offset, child_count + 1, &options);
+				}
+				return transform_file(input, fd[1], options.stages[stage - 1], child_count + 1);
+			}
 
-			/* If not, print error message and cancel other child */
-			else {
-				/* Print error */
-				printf("ERROR: Child %d finished abnormally with status %d\n", child_number, status);
+			/* Close the pipe ends of the child for parent */
+			if(input >= 0) {
+				close(input);
+			}
+			if(fd[1] >= 0) {
+				close(fd[1]);
+			}
+			input = fd[0];
 
-				/* Set error flag */
+			/* Code for error handling, forked children see the closed pipes and finish */
+			if(children[child_count] < 0) {
+				printf("ERROR: Unable to for process!\n");
 				error = true;
+				break;
 			}
+			child_count++;
 		}
-
-		/* Print message that all childs are terminated */
-		if(!error) {
-			printf("SUCCESS: All children are terminated normally.\n");
-			return 0;
-		} else {
-			printf("ERROR: One or more child finished abnormally. Operation failed.\n");
-			return 2;
+		if(input >= 0) {
+			close(input);
 		}
 	}
 
-	/* Code for child 1 (read file) */
-	if(child_1 == 0) {
-		/* Close read end of pipe */
-		close(fd[0]);
+	/* Wait for all childs to finish */
+	for(uint32_t i=0; i<child_count; i++) {
+		/* Wait for one child to terminate */
+		int status;
+		pid_t done = wait(&status);
+
+		/* Check which child is done */
+		uint32_t child_number = 0;
+		for(uint32_t j=0; j<child_count; j++) {
+			if(children[j] == done) {
+				child_number = j + 1;
+			}
+		}
 
-		/* Open file pointer for source and handle error */
-		int src = open(argv[1], O_RDONLY);
-		if(src < 0) {
-			printf("ERROR: Unable to open source file \"%s\" (%s)\n", argv[1], strerror(errno));	
-			close(fd[1]);		
-			return 1;
-		}		
-
-		/* Copy from file to pipe */
-		if(copy(src, fd[1], 1) < 0) {
-			printf("ERROR: error while copying: %s\n", strerror(errno));	
-			close(src);
-			close(fd[1]);
-			return 2;
+		/* If the child exited with status 0, print successull text */
+		if(WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+			printf("SUCCESS: Child %d finished normally.\n", child_number);
 		}
 
-		/* Close file and pipe */
-		close(src);
-		close(fd[1]);
+		/* If not, print error message and cancel other child. A killed child is a failure too. */
+		else {
+			/* Print error */
+			if(WIFSIGNALED(status)) {
+				printf("ERROR: Child %d was killed by signal %d\n", child_number, WTERMSIG(status));
+			} else {
+				printf("ERROR: Child %d finished abnormally with status %d\n", child_number, WEXITSTATUS(status));
+			}
 
+			/* Set error flag */
+			error = true;
+
+			/* The other child doesn't see a closed pipe, so wake it up */
+			if(options.ring) {
+				ring_abort(options.shared_ring);
+			}
+		}
+	}
+	free(children);
+	progress_stop();
+
+	/* Print how often the children had to sleep on the ring */
+	if(options.ring) {
+		uint64_t producer_waits, consumer_waits;
+		ring_waits(options.shared_ring, &producer_waits, &consumer_waits);
+		printf("RING: reader slept %" PRIu64 " times on a full ring, writer %" PRIu64 " times on an empty ring\n",
+			producer_waits, consumer_waits);
+		ring_destroy(options.shared_ring);
+	}
+
+	/* Print message that all childs are terminated */
+	if(!error) {
+		printf("SUCCESS: All children are terminated normally.\n");
 		return 0;
+	} else {
+		printf("ERROR: One or more child finished abnormally. Operation failed.\n");
+		return 2;
+	}
+}
+
+int read_file(int pipe_fd, uint64_t offset, uint64_t count, int pid, pipe_options_t *options) {
+	/* Open file pointer for source and handle error */
+	int src = open(options->src, O_RDONLY);
+	if(src < 0) {
+		printf("ERROR: Unable to open source file \"%s\" (%s)\n", options->src, strerror(errno));
+		close(pipe_fd);
+		return 1;
 	}
 
-	/* Code for child 2 (write file) */
-	if(child_2 == 0) {
-		/* Close write end of pipe */
-		close(fd[1]);
+	/* Start at the range of the stripe */
+	if(offset > 0 && lseek(src, offset, SEEK_SET) < 0) {
+		printf("ERROR: error while seeking: %s\n", strerror(errno));
+		close(src);
+		close(pipe_fd);
+		return 2;
+	}
 
-		/* Open file pointer for destination and handle error */
-		int dest = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
-		if(dest < 0) {
-			printf("ERROR: Unable to open destination file \"%s\" (%s)\n", argv[2], strerror(errno));	
-			close(fd[0]);
-			return 1;
-		}	
-
-		/* Copy from pipe to file */
-		if(copy(fd[0], dest, 2) < 0) {
-			printf("ERROR: error while copying: %s\n", strerror(errno));	
-			close(dest);
-			close(fd[0]);
-			return 2;
-		}
+	/* Copy from file to pipe, or produce the ring */
+	int64_t copied_count = options->ring ? ring_produce(options->shared_ring, src) : copy(src, pipe_fd, count, pid, options);
+	if(copied_count < 0) {
+		printf("ERROR: error while copying: %s\n", strerror(errno));
+		close(src);
+		close(pipe_fd);
+		return 2;
+	}
 
-		/* Close file and pipe */
-		close(dest);
-		close(fd[0]);
+	/* Close file and pipe */
+	close(src);
+	close(pipe_fd);
 
-		return 0;
+	return 0;
+}
+
+int transform_file(int input_fd, int output_fd, transform_t transform, int pid) {
+	/* Transform from pipe to pipe */
+	transform_result_t result;
+	if(transform_stream(input_fd, output_fd, transform, &result) < 0) {
+		printf("ERROR: error while transforming: %s\n", strerror(errno));
+		close(input_fd);
+		close(output_fd);
+		return 2;
+	}
+
+	/* Print what the stage saw */
+	if(transform == TRANSFORM_CRC32C) {
+		printf("[%d] STAGE: crc32c %08x over %" PRIu64 " bytes\n", pid, result.checksum, result.in_count);
+	} else {
+		printf("[%d] STAGE: %s %" PRIu64 " -> %" PRIu64 " bytes\n", pid, transform_name(transform), result.in_count, result.out_count);
 	}
 
-	/* Code for error handling */
-	if(child_1 < 0 || child_2 < 0) {
-		printf("ERROR: Unable to for process!\n");
+	/* Close pipes */
+	close(input_fd);
+	close(output_fd);
 
-		/* If child 1 is already forked, we just let it finish normally */
+	return 0;
+}
+
+int write_file(int pipe_fd, uint64_t offset, int pid, pipe_options_t *options) {
+	/* Open file pointer for destination and handle error, stripes keep the prepared file */
+	int dest = open(options->dest, O_WRONLY | O_CREAT | (options->stripe_count > 1 ? 0 : O_TRUNC), S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+	if(dest < 0) {
+		printf("ERROR: Unable to open destination file \"%s\" (%s)\n", options->dest, strerror(errno));
+		close(pipe_fd);
+		return 1;
+	}
+
+	/* Start at the range of the stripe */
+	if(offset > 0 && lseek(dest, offset, SEEK_SET) < 0) {
+		printf("ERROR: error while seeking: %s\n", strerror(errno));
+		close(dest);
+		close(pipe_fd);
+		return 2;
+	}
 
+	/* Throttle the writer, it is the one touching the disk */
+	if(throttle_start(&options->throttle) != 0) {
+		close(dest);
+		close(pipe_fd);
 		return 1;
 	}
 
+	/* Copy from pipe to file, or consume the ring */
+	int64_t copied_count = options->ring ? ring_consume(options->shared_ring, dest) : copy(pipe_fd, dest, UINT64_MAX, pid, options);
+	if(copied_count < 0) {
+		printf("ERROR: error while copying: %s\n", strerror(errno));
+		close(dest);
+		close(pipe_fd);
+		return 2;
+	}
+
+	/* Close file and pipe */
+	close(dest);
+	close(pipe_fd);
+
 	return 0;
 }
 
+bool parse_options(int argc, char const *argv[], pipe_options_t *options) {
+	/* Set defaults */
+	memset(options, 0, sizeof(pipe_options_t));
+	options->queue_depth = COPY_URING_QUEUE_DEPTH;
+	options->pipe_size = COPY_PIPE_SIZE;
+	options->stripe_count = 1;
+
+	/* Define long options */
+	static const struct option long_options[] = {
+		{"uring", no_argument, NULL, 'u'},
+		{"queue-depth", required_argument, NULL, 'q'},
+		{"sparse", no_argument, NULL, 's'},
+		{"read-write", no_argument, NULL, 'w'},
+		{"ring", no_argument, NULL, 'R'},
+		{"pipe-size", required_argument, NULL, 'S'},
+		{"stripes", required_argument, NULL, 'K'},
+		{"stage", required_argument, NULL, 'X'},
+		{"progress", required_argument, NULL, 'P'},
+		{"bwlimit", required_argument, NULL, 'B'},
+		{"iops", required_argument, NULL, 'I'},
+		{"adaptive", no_argument, NULL, 'A'},
+		{"throttle-file", required_argument, NULL, 'T'},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Parse options, errors are printed by us */
+	opterr = 0;
+	int option;
+	uint64_t value;
+	while((option = getopt_long(argc, (char * const *) argv, "", long_options, NULL)) != -1) {
+		switch(option) {
+			case 'u':
+				options->uring = true;
+				break;
+
+			case 'q':
+				if(!parse_size(optarg, &value) || value == 0 || value > COPY_URING_MAX_QUEUE_DEPTH) {
+					printf("ERROR: Invalid queue depth \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->queue_depth = value;
+				break;
+
+			case 's':
+				options->sparse = true;
+				break;
+
+			case 'w':
+				options->read_write = true;
+				break;
+
+			case 'R':
+				options->ring = true;
+				break;
+
+			case 'S':
+				if(strcmp(optarg, "max") == 0) {
+					options->pipe_size = 0;
+				} else if(!parse_size(optarg, &options->pipe_size) || options->pipe_size == 0) {
+					printf("ERROR: Invalid pipe size \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'K':
+				if(!parse_size(optarg, &value) || value == 0 || value > COPY_MAX_STRIPES) {
+					printf("ERROR: Invalid stripe count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->stripe_count = value;
+				break;
+
+			case 'X':
+				if(options->stage_count == COPY_MAX_STAGES || !transform_parse(optarg, &options->stages[options->stage_count])) {
+					printf("ERROR: Invalid stage \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				options->stage_count++;
+				break;
+
+			case 'P':
+				if(!progress_parse_mode(optarg, &options->progress, &options->progress_shm_name)) {
+					printf("ERROR: Invalid progress mode \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'B':
+				if(!parse_size(optarg, &options->throttle.byte_rate)) {
+					printf("ERROR: Invalid bandwidth limit \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'I':
+				if(!parse_size(optarg, &options->throttle.op_rate)) {
+					printf("ERROR: Invalid IOPS limit \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'A':
+				options->throttle.adaptive = true;
+				break;
+
+			case 'T':
+				options->throttle.control_file = optarg;
+				break;
+
+			default:
+				printf("ERROR: Invalid option. %s\n", USAGE);
+				return false;
+		}
+	}
+
+	/* Only the block loop can be throttled */
+	if(throttle_requested(&options->throttle) && (options->uring || options->sparse)) {
+		printf("ERROR: Throttling can't be combined with other modes. %s\n", USAGE);
+		return false;
+	}
+
+	/* Stripes copy ranges, the other modes copy whole streams */
+	if(options->stripe_count > 1 && (options->uring || options->sparse || options->ring)) {
+		printf("ERROR: Stripes can't be combined with other modes. %s\n", USAGE);
+		return false;
+	}
+
+	/* Stages are connected by pipes, the ring replaces the only one there is */
+	if(options->stage_count > 0 && (options->stripe_count > 1 || options->ring)) {
+		printf("ERROR: Stages can't be combined with stripes or the ring. %s\n", USAGE);
+		return false;
+	}
+
+	/* Check number of remaining arguments */
+	if(argc - optind < 2) {
+		printf("ERROR: Too few arguments. %s\n", USAGE);
+		return false;
+	}
+
+	/* Set files */
+	options->src = argv[optind];
+	options->dest = argv[optind + 1];
+
+	return true;
+}
+
 /* Copies the content from the src file handler to the dest file handler. */
-int16_t copy(int src, int dest, int pid) {
-	/* Create buffer and counter */
-	uint8_t buffer[BLOCK_SIZE];
-	int16_t read_count = 0;
+int64_t copy(int src, int dest, uint64_t count, int pid, pipe_options_t *options) {
+	/* Let io_uring keep many blocks in flight, the pipe end is written or read in order */
+	if(options->uring) {
+		copy_path_t path = COPY_PATH_NONE;
+		int64_t copied_count = copy_uring(src, dest, options->queue_depth, &path);
+		printf("[%d] PATH: %s\n", pid, copy_path_name(path));
+		return copied_count;
+	}
+
+	/* Skip the holes of the source and recreate them from the zeros in the pipe */
+	if(options->sparse) {
+		copy_path_t path = COPY_PATH_NONE;
+		return copy_sparse(src, dest, &path);
+	}
+
+	/* Move the pages between the file and the pipe by reference, unless the throttle has to see
+	   every block */
+	if(!options->read_write && !throttle_requested(&options->throttle)) {
+		copy_path_t path = COPY_PATH_NONE;
+		int64_t copied_count = copy_splice(src, dest, count, &path);
+		printf("[%d] PATH: %s\n", pid, copy_path_name(path));
+		return copied_count;
+	}
+
+	/* Use the buffer of this thread, throttled copies move blocks as large as the ones of MyCopy so
+	   the limits don't cost a write per KiB */
+	uint8_t *buffer = copy_buffer();
+	if(buffer == NULL) {
+		return -1;
+	}
+	uint64_t block_size = throttle_requested(&options->throttle) ? THROTTLE_BLOCK_SIZE : BLOCK_SIZE;
+	uint64_t copied_count = 0;
+	ssize_t read_count = 0;
 
 	/* Copy blocks */
-	while((read_count = read(src, buffer, BLOCK_SIZE)) > 0) {
-		printf("[%d] %d bytes copied...\n", pid, read_count);
-		write(dest, buffer, read_count);
+	while(copied_count < count && (read_count = read(src, buffer, count - copied_count < block_size ? count - copied_count : block_size)) != 0) {
+		/* Retry if interrupted, cancel on errors */
+		if(read_count < 0) {
+			if(errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		if(write_throttled(dest, buffer, read_count) != 0) {
+			return -1;
+		}
+
+		copied_count += read_count;
+		progress_add(read_count);
 	}
 
-	return read_count;
-}
\ No newline at end of file
+	return copied_count;
+}
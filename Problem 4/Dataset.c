@@ -0,0 +1,376 @@
+/*
+ * Dataset.c
+ * Author: Christian Würthner
+ * Description: Creates the sample data StopWatch copies, with several threads.
+ */
+
+#define _GNU_SOURCE
+
+#include "Dataset.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+/* Every thread fills and writes chunks of this size */
+#define DATASET_CHUNK_SIZE (4 * 1024 * 1024) /* 4 MiB */
+
+/* Sparse files have DATASET_SPARSE_DATA bytes of data at the start of every segment */
+#define DATASET_SPARSE_SEGMENT (1024 * 1024) /* 1 MiB */
+#define DATASET_SPARSE_DATA (64 * 1024) /* 64 KiB */
+
+/* Sizes of the small files are powers of two between these exponents plus up to the same again */
+#define DATASET_SMALL_FILE_MIN_BITS 9 /* 512 bytes */
+#define DATASET_SMALL_FILE_MAX_BITS 15 /* 32 KiB, so at most 64 KiB */
+#define DATASET_FILES_PER_DIRECTORY 256
+
+/* Upper limit for the number of threads */
+#define DATASET_MAX_THREADS 64
+
+/* Structure shared by all threads */
+typedef struct {
+	const char *name;
+	dataset_pattern_t pattern;
+	uint64_t size;
+	int fd;
+	uint64_t unit_count;
+	uint64_t next_unit;
+	uint32_t *file_sizes;
+	int error;
+} dataset_t;
+
+/* Words of the text pattern, a power of two of them */
+static const char *dataset_words[64] = {
+	"the", "of", "and", "to", "in", "is", "that", "for", "it", "as", "was", "with", "be", "by", "on", "not",
+	"he", "this", "are", "or", "his", "from", "at", "which", "but", "have", "an", "had", "they", "you", "were", "their",
+	"one", "all", "we", "can", "her", "has", "there", "been", "if", "more", "when", "will", "would", "who", "so", "no",
+	"copy", "file", "buffer", "process", "child", "pipe", "kernel", "page", "cache", "disk", "block", "write", "read", "error", "status", "time"
+};
+
+/* Thread taking the next chunk or file until all are written */
+static void *dataset_worker(void *args_v);
+
+/* Fills and writes one chunk of the file, or one segment of a sparse file. Returns 0 or -1. */
+static int dataset_write_chunk(dataset_t *dataset, uint64_t index, uint8_t *buffer);
+
+/* Fills and writes one of the small files. Returns 0 or -1. */
+static int dataset_write_file(dataset_t *dataset, uint64_t index, uint8_t *buffer);
+
+/* Fills the buffer with the pattern, the PRNG is seeded with the index of the chunk or file */
+static void dataset_fill(dataset_pattern_t pattern, uint64_t seed, uint8_t *buffer, size_t length);
+
+/* Draws the sizes of the small files and creates their directories, returns the file count */
+static int64_t dataset_plan_files(dataset_t *dataset);
+
+/* Writes count bytes at offset, returns 0 or -1 */
+static int dataset_pwrite(int fd, const uint8_t *buffer, size_t count, uint64_t offset);
+
+/* xoshiro256** seeded with splitmix64, fast enough to produce several GB/s per thread */
+static void dataset_seed(uint64_t state[4], uint64_t seed);
+static uint64_t dataset_next(uint64_t state[4]);
+
+int dataset_create(const char *name, uint64_t size, dataset_pattern_t pattern, uint32_t thread_count) {
+	dataset_t dataset;
+	memset(&dataset, 0, sizeof(dataset_t));
+	dataset.name = name;
+	dataset.pattern = pattern;
+	dataset.size = size;
+	dataset.fd = -1;
+
+	/* Small files are a tree, everything else one file with the full size. Its holes are filled
+	   by the threads in any order, the sparse pattern keeps most of them. */
+	if(pattern == DATASET_SMALL_FILES) {
+		int64_t file_count = dataset_plan_files(&dataset);
+		if(file_count < 0) {
+			return -1;
+		}
+		dataset.unit_count = file_count;
+	} else {
+		dataset.fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if(dataset.fd < 0) {
+			return -1;
+		}
+		if(ftruncate(dataset.fd, size) != 0) {
+			int error = errno;
+			close(dataset.fd);
+			errno = error;
+			return -1;
+		}
+		uint64_t unit_size = pattern == DATASET_SPARSE ? DATASET_SPARSE_SEGMENT : DATASET_CHUNK_SIZE;
+		dataset.unit_count = (size + unit_size - 1) / unit_size;
+	}
+
+	/* Start the threads, the current thread writes as well */
+	if(thread_count == 0) {
+		long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+		thread_count = cpu_count > 0 ? cpu_count : 1;
+	}
+	if(thread_count > DATASET_MAX_THREADS) {
+		thread_count = DATASET_MAX_THREADS;
+	}
+	if(thread_count > dataset.unit_count) {
+		thread_count = dataset.unit_count > 0 ? dataset.unit_count : 1;
+	}
+	pthread_t threads[DATASET_MAX_THREADS];
+	uint32_t started = 0;
+	for(; started + 1<thread_count; started++) {
+		if(pthread_create(threads + started, NULL, dataset_worker, &dataset) != 0) {
+			break;
+		}
+	}
+	dataset_worker(&dataset);
+
+	/* Wait for all threads */
+	for(uint32_t i=0; i<started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(dataset.file_sizes);
+
+	/* Errors of delayed writes are reported here */
+	if(dataset.fd >= 0 && close(dataset.fd) != 0 && dataset.error == 0) {
+		dataset.error = errno;
+	}
+	if(dataset.error != 0) {
+		errno = dataset.error;
+		return -1;
+	}
+
+	return 0;
+}
+
+bool dataset_parse(const char *text, dataset_pattern_t *pattern) {
+	if(strcmp(text, "random") == 0) {
+		*pattern = DATASET_RANDOM;
+	} else if(strcmp(text, "zeros") == 0) {
+		*pattern = DATASET_ZEROS;
+	} else if(strcmp(text, "sparse") == 0) {
+		*pattern = DATASET_SPARSE;
+	} else if(strcmp(text, "text") == 0) {
+		*pattern = DATASET_TEXT;
+	} else if(strcmp(text, "small-files") == 0) {
+		*pattern = DATASET_SMALL_FILES;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+const char *dataset_name(dataset_pattern_t pattern) {
+	switch(pattern) {
+		case DATASET_RANDOM: return "random";
+		case DATASET_ZEROS: return "zeros";
+		case DATASET_SPARSE: return "sparse";
+		case DATASET_TEXT: return "text";
+		case DATASET_SMALL_FILES: return "small-files";
+		default: return "none";
+	}
+}
+
+static void *dataset_worker(void *args_v) {
+	dataset_t *dataset = (dataset_t*) args_v;
+
+	uint8_t *buffer = malloc(DATASET_CHUNK_SIZE);
+	if(buffer == NULL) {
+		int expected = 0;
+		__atomic_compare_exchange_n(&dataset->error, &expected, ENOMEM, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		return NULL;
+	}
+
+	while(__atomic_load_n(&dataset->error, __ATOMIC_RELAXED) == 0) {
+		/* Claim the next chunk or file */
+		uint64_t index = __atomic_fetch_add(&dataset->next_unit, 1, __ATOMIC_RELAXED);
+		if(index >= dataset->unit_count) {
+			break;
+		}
+
+		/* Keep the first error, the others stop */
+		int result = dataset->pattern == DATASET_SMALL_FILES ? dataset_write_file(dataset, index, buffer) :
+			dataset_write_chunk(dataset, index, buffer);
+		if(result != 0) {
+			int expected = 0;
+			__atomic_compare_exchange_n(&dataset->error, &expected, errno, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static int dataset_write_chunk(dataset_t *dataset, uint64_t index, uint8_t *buffer) {
+	/* Sparse files only get the data at the start of the segment, the rest stays a hole */
+	uint64_t offset, length;
+	if(dataset->pattern == DATASET_SPARSE) {
+		offset = index * DATASET_SPARSE_SEGMENT;
+		length = DATASET_SPARSE_DATA;
+	} else {
+		offset = index * DATASET_CHUNK_SIZE;
+		length = DATASET_CHUNK_SIZE;
+	}
+	if(length > dataset->size - offset) {
+		length = dataset->size - offset;
+	}
+
+	dataset_fill(dataset->pattern, index, buffer, length);
+	return dataset_pwrite(dataset->fd, buffer, length, offset);
+}
+
+static int dataset_write_file(dataset_t *dataset, uint64_t index, uint8_t *buffer) {
+	char path[4096];
+	snprintf(path, sizeof(path), "%s/dir_%04llu/file_%06llu", dataset->name,
+		(unsigned long long) (index / DATASET_FILES_PER_DIRECTORY), (unsigned long long) index);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+	if(fd < 0) {
+		return -1;
+	}
+
+	/* The files hold random data, like the compressed or binary files of real trees */
+	uint32_t length = dataset->file_sizes[index];
+	dataset_fill(DATASET_RANDOM, index, buffer, length);
+	int result = dataset_pwrite(fd, buffer, length, 0);
+	if(close(fd) != 0) {
+		result = -1;
+	}
+
+	return result;
+}
+
+static void dataset_fill(dataset_pattern_t pattern, uint64_t seed, uint8_t *buffer, size_t length) {
+	if(pattern == DATASET_ZEROS) {
+		memset(buffer, 0, length);
+		return;
+	}
+
+	/* Mix in the pattern so the patterns don't share their data */
+	uint64_t state[4];
+	dataset_seed(state, seed * 8 + pattern);
+
+	/* Words separated by spaces, lines of 6 to 13 words */
+	if(pattern == DATASET_TEXT) {
+		size_t position = 0;
+		uint32_t line_words = 0;
+		while(position < length) {
+			/* One random value picks ten words and the length of the line */
+			uint64_t random = dataset_next(state);
+			for(uint8_t i=0; i<10 && position < length; i++) {
+				const char *word = dataset_words[(random >> (6 * i)) & 63];
+				size_t word_length = strlen(word);
+				if(word_length > length - position) {
+					word_length = length - position;
+				}
+				memcpy(buffer + position, word, word_length);
+				position += word_length;
+				if(position < length) {
+					buffer[position++] = ++line_words >= 6 + (random >> 61) ? '\n' : ' ';
+					if(buffer[position - 1] == '\n') {
+						line_words = 0;
+					}
+				}
+			}
+		}
+		return;
+	}
+
+	/* Random data, 8 bytes per step */
+	size_t position = 0;
+	for(; position + sizeof(uint64_t) <= length; position += sizeof(uint64_t)) {
+		uint64_t random = dataset_next(state);
+		memcpy(buffer + position, &random, sizeof(uint64_t));
+	}
+	if(position < length) {
+		uint64_t random = dataset_next(state);
+		memcpy(buffer + position, &random, length - position);
+	}
+}
+
+static int64_t dataset_plan_files(dataset_t *dataset) {
+	/* Draw sizes until the total is reached, the last file gets the rest */
+	uint64_t state[4];
+	dataset_seed(state, DATASET_SMALL_FILES);
+	uint64_t file_count = 0, capacity = 0, total = 0;
+	while(total < dataset->size) {
+		if(file_count == capacity) {
+			capacity = capacity > 0 ? capacity * 2 : 1024;
+			uint32_t *grown = realloc(dataset->file_sizes, sizeof(uint32_t) * capacity);
+			if(grown == NULL) {
+				free(dataset->file_sizes);
+				dataset->file_sizes = NULL;
+				errno = ENOMEM;
+				return -1;
+			}
+			dataset->file_sizes = grown;
+		}
+
+		uint64_t random = dataset_next(state);
+		uint32_t bits = DATASET_SMALL_FILE_MIN_BITS + random % (DATASET_SMALL_FILE_MAX_BITS - DATASET_SMALL_FILE_MIN_BITS + 1);
+		uint64_t size = (1u << bits) + (random >> 32) % (1u << bits);
+		if(size > dataset->size - total) {
+			size = dataset->size - total;
+		}
+		dataset->file_sizes[file_count++] = size;
+		total += size;
+	}
+
+	/* Create the directories, the threads only create files */
+	char path[4096];
+	bool failed = mkdir(dataset->name, 0777) != 0 && errno != EEXIST;
+	for(uint64_t i=0; !failed && i<file_count; i+=DATASET_FILES_PER_DIRECTORY) {
+		snprintf(path, sizeof(path), "%s/dir_%04llu", dataset->name, (unsigned long long) (i / DATASET_FILES_PER_DIRECTORY));
+		failed = mkdir(path, 0777) != 0 && errno != EEXIST;
+	}
+	if(failed) {
+		int error = errno;
+		free(dataset->file_sizes);
+		dataset->file_sizes = NULL;
+		errno = error;
+		return -1;
+	}
+
+	return file_count;
+}
+
+static int dataset_pwrite(int fd, const uint8_t *buffer, size_t count, uint64_t offset) {
+	while(count > 0) {
+		ssize_t written = pwrite(fd, buffer, count, offset);
+		if(written < 0 && errno == EINTR) {
+			continue;
+		}
+		if(written <= 0) {
+			if(written == 0) {
+				errno = EIO;
+			}
+			return -1;
+		}
+		buffer += written;
+		count -= written;
+		offset += written;
+	}
+
+	return 0;
+}
+
+static void dataset_seed(uint64_t state[4], uint64_t seed) {
+	for(uint8_t i=0; i<4; i++) {
+		seed += 0x9E3779B97F4A7C15ull;
+		uint64_t z = seed;
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		state[i] = z ^ (z >> 31);
+	}
+}
+
+static uint64_t dataset_next(uint64_t state[4]) {
+	uint64_t result = ((state[1] * 5) << 7 | (state[1] * 5) >> 57) * 9;
+	uint64_t t = state[1] << 17;
+	state[2] ^= state[0];
+	state[3] ^= state[1];
+	state[1] ^= state[2];
+	state[0] ^= state[3];
+	state[2] ^= t;
+	state[3] = state[3] << 45 | state[3] >> 19;
+	return result;
+}
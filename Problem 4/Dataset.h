@@ -0,0 +1,35 @@
+/*
+ * Dataset.h
+ * Author: Christian Würthner
+ * Description: Creates the sample data StopWatch copies, with several threads.
+ */
+
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Kinds of data. Random data is incompressible, sparse files have a 64 KiB extent of random data
+   at the start of every MiB and holes in between, text is words and lines like a log or source
+   file and small files are a directory tree of files between 512 bytes and 64 KiB. */
+typedef enum {
+	DATASET_RANDOM,
+	DATASET_ZEROS,
+	DATASET_SPARSE,
+	DATASET_TEXT,
+	DATASET_SMALL_FILES
+} dataset_pattern_t;
+
+/* Creates name with size bytes of the pattern, a directory for DATASET_SMALL_FILES. The data
+   only depends on the pattern and the size, not on the number of threads. thread_count 0 uses one
+   thread per CPU. Returns 0 or -1 and sets errno. */
+int dataset_create(const char *name, uint64_t size, dataset_pattern_t pattern, uint32_t thread_count);
+
+/* Parses the name of a pattern, returns false if it is unknown */
+bool dataset_parse(const char *text, dataset_pattern_t *pattern);
+
+/* Returns a printable name for the given pattern */
+const char *dataset_name(dataset_pattern_t pattern);
+
+#endif
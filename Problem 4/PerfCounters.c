@@ -0,0 +1,191 @@
+/*
+ * PerfCounters.c
+ * Author: Christian Würthner
+ * Description: Starts a program with perf_event_open() counters attached to it and its children.
+ */
+
+#define _GNU_SOURCE
+
+#include "PerfCounters.h"
+#include "../Problem 2/Launcher.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/* Type and configuration of every counter */
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} perf_events[PERF_COUNTER_COUNT] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK}
+};
+
+/* Events that failed once are not tried again */
+static bool perf_unavailable[PERF_COUNTER_COUNT];
+
+/* Events that are only counted in user space, the hint is printed once */
+static bool perf_user_only[PERF_COUNTER_COUNT];
+
+/* Opens the counter for the stopped child, returns the descriptor or -1 */
+static int perf_open(perf_counter_t counter, pid_t pid);
+
+/* Reads the counter scaled to the whole run, returns -1 on errors */
+static double perf_read(int fd);
+
+int perf_launch_and_wait(const char *program, char *const argv[], bool null_stdio, struct rusage *usage, perf_counters_t *counters) {
+	for(uint8_t i=0; i<PERF_COUNTER_COUNT; i++) {
+		counters->values[i] = -1;
+	}
+
+	/* The child waits on the gate until its counters are open */
+	int gate[2];
+	if(pipe2(gate, O_CLOEXEC) != 0) {
+		return -1;
+	}
+
+	/* Fork process */
+	pid_t pid = fork();
+
+	/* Child code */
+	if(pid == 0) {
+		close(gate[1]);
+		char go;
+		if(read(gate[0], &go, 1) != 1) {
+			_exit(EXECLP_ERROR);
+		}
+
+		/* Redirect output to /dev/null/ */
+		if(null_stdio) {
+			int dev_null_in = open("/dev/null", O_RDONLY);
+			int dev_null_out = open("/dev/null", O_WRONLY);
+			dup2(dev_null_in, STDIN_FILENO);
+			dup2(dev_null_out, STDOUT_FILENO);
+		}
+
+		/* exec, the counters start here */
+		execvp(program, argv);
+
+		/* If this code is executed, execvp failed. */
+		_exit(EXECLP_ERROR);
+	}
+
+	close(gate[0]);
+	if(pid < 0) {
+		int error = errno;
+		close(gate[1]);
+		errno = error;
+		return -1;
+	}
+
+	/* Attach the counters and let the child go */
+	int fds[PERF_COUNTER_COUNT];
+	for(uint8_t i=0; i<PERF_COUNTER_COUNT; i++) {
+		fds[i] = perf_open(i, pid);
+	}
+	if(write(gate[1], "x", 1) != 1) {
+		kill(pid, SIGKILL);
+	}
+	close(gate[1]);
+
+	/* Wait for the child, retry if interrupted */
+	int status;
+	struct rusage child_usage;
+	while(wait4(pid, &status, 0, usage != NULL ? usage : &child_usage) < 0) {
+		if(errno != EINTR) {
+			status = -1;
+			break;
+		}
+	}
+
+	/* All children are gone, so their counts are added to the ones of the child */
+	for(uint8_t i=0; i<PERF_COUNTER_COUNT; i++) {
+		if(fds[i] >= 0) {
+			counters->values[i] = perf_read(fds[i]);
+			close(fds[i]);
+		}
+	}
+	if(counters->values[PERF_TASK_CLOCK] > 0) {
+		counters->values[PERF_TASK_CLOCK] /= 1000000.;
+	}
+
+	return status;
+}
+
+const char *perf_counter_name(perf_counter_t counter) {
+	switch(counter) {
+		case PERF_CYCLES: return "cycles";
+		case PERF_INSTRUCTIONS: return "instructions";
+		case PERF_CACHE_MISSES: return "cache-misses";
+		case PERF_BRANCH_MISSES: return "branch-misses";
+		case PERF_CONTEXT_SWITCHES: return "context-switches";
+		case PERF_PAGE_FAULTS: return "page-faults";
+		case PERF_TASK_CLOCK: return "task-clock";
+		default: return "none";
+	}
+}
+
+static int perf_open(perf_counter_t counter, pid_t pid) {
+	if(perf_unavailable[counter]) {
+		return -1;
+	}
+
+	/* Count the child and everything it starts, beginning with its exec */
+	struct perf_event_attr attributes;
+	memset(&attributes, 0, sizeof(attributes));
+	attributes.size = sizeof(attributes);
+	attributes.type = perf_events[counter].type;
+	attributes.config = perf_events[counter].config;
+	attributes.disabled = 1;
+	attributes.inherit = 1;
+	attributes.enable_on_exec = 1;
+	attributes.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	int fd = syscall(SYS_perf_event_open, &attributes, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+
+	/* Unprivileged users may only count user space with the default perf_event_paranoid. These
+	   counts miss the kernel, so they can't be compared with full ones. */
+	if(fd < 0 && (errno == EACCES || errno == EPERM)) {
+		attributes.exclude_kernel = 1;
+		attributes.exclude_hv = 1;
+		fd = syscall(SYS_perf_event_open, &attributes, pid, -1, -1, PERF_FLAG_FD_CLOEXEC);
+		if(fd >= 0 && !perf_user_only[counter]) {
+			fprintf(stderr, "HINT: perf_event_open() only counts %s in user space (perf_event_paranoid), the kernel is not included.\n", perf_counter_name(counter));
+			perf_user_only[counter] = true;
+		}
+	}
+
+	/* Containers and virtual machines often have no PMU, or no perf_event_open() at all */
+	if(fd < 0) {
+		fprintf(stderr, "HINT: perf_event_open() can't count %s (%s), it is reported as n/a.\n", perf_counter_name(counter), strerror(errno));
+		perf_unavailable[counter] = true;
+	}
+
+	return fd;
+}
+
+static double perf_read(int fd) {
+	/* Value, time enabled and time running */
+	uint64_t data[3];
+	if(read(fd, data, sizeof(data)) != sizeof(data)) {
+		return -1;
+	}
+
+	/* The counter only ran part of the time if there were more events than hardware counters */
+	if(data[2] > 0 && data[2] < data[1]) {
+		return data[0] * ((double) data[1] / data[2]);
+	}
+
+	return data[0];
+}
@@ -0,0 +1,42 @@
+/*
+ * PerfCounters.h
+ * Author: Christian Würthner
+ * Description: Starts a program with perf_event_open() counters attached to it and its children.
+ */
+
+#ifndef PERF_COUNTERS_H
+#define PERF_COUNTERS_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+/* The counted events, the hardware events first */
+typedef enum {
+	PERF_CYCLES,
+	PERF_INSTRUCTIONS,
+	PERF_CACHE_MISSES,
+	PERF_BRANCH_MISSES,
+	PERF_CONTEXT_SWITCHES,
+	PERF_PAGE_FAULTS,
+	PERF_TASK_CLOCK,
+	PERF_COUNTER_COUNT
+} perf_counter_t;
+
+/* Values of all counters, -1 if the event couldn't be counted. The task clock is in ms. Counters
+   that had to share the hardware with others are scaled to the whole run. */
+typedef struct {
+	double values[PERF_COUNTER_COUNT];
+} perf_counters_t;
+
+/* Starts program like launch_and_wait() with fork() and execvp(). The counters are opened for
+   the child before it calls exec, start with the exec and are inherited by all children it
+   creates. Hardware events the kernel, the CPU or the container don't provide are skipped, the
+   software events don't need a PMU. Returns the wait status, a program that couldn't be executed
+   finishes with EXECLP_ERROR. Returns -1 with errno if the child couldn't be created or waited for. */
+int perf_launch_and_wait(const char *program, char *const argv[], bool null_stdio, struct rusage *usage, perf_counters_t *counters);
+
+/* Returns a printable name for the given counter */
+const char *perf_counter_name(perf_counter_t counter);
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Statistics.c
+ * Author: Christian Würthner
+ * Description: Summary statistics of the run times measured by StopWatch.
+ */
+
+#include "Statistics.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Returns the quantile q of the sorted samples, interpolating between the closest ranks */
+static double quantile(const double *sorted, uint32_t count, double q);
+
+/* Orders doubles for qsort() */
+static int compare_doubles(const void *a, const void *b);
+
+void statistics_compute(const double *samples, uint32_t count, statistics_t *statistics) {
+	memset(statistics, 0, sizeof(statistics_t));
+	statistics->count = count;
+	if(count == 0) {
+		return;
+	}
+
+	/* The quantiles need the samples in order */
+	double *sorted = malloc(sizeof(double) * count);
+	if(sorted == NULL) {
+		statistics->count = 0;
+		return;
+	}
+	memcpy(sorted, samples, sizeof(double) * count);
+	qsort(sorted, count, sizeof(double), compare_doubles);
+
+	/* Mean and the standard deviation of the sample */
+	double sum = 0;
+	for(uint32_t i=0; i<count; i++) {
+		sum += sorted[i];
+	}
+	statistics->mean = sum / count;
+	double squares = 0;
+	for(uint32_t i=0; i<count; i++) {
+		squares += (sorted[i] - statistics->mean) * (sorted[i] - statistics->mean);
+	}
+	statistics->stddev = count > 1 ? sqrt(squares / (count - 1)) : 0;
+
+	/* Order statistics */
+	statistics->min = sorted[0];
+	statistics->max = sorted[count - 1];
+	statistics->median = quantile(sorted, count, .5);
+	statistics->p95 = quantile(sorted, count, .95);
+	statistics->p99 = quantile(sorted, count, .99);
+
+	/* Tukey's fences */
+	double q1 = quantile(sorted, count, .25);
+	double q3 = quantile(sorted, count, .75);
+	statistics->low_fence = q1 - 1.5 * (q3 - q1);
+	statistics->high_fence = q3 + 1.5 * (q3 - q1);
+	for(uint32_t i=0; i<count; i++) {
+		statistics->outlier_count += statistics_is_outlier(statistics, sorted[i]);
+	}
+
+	free(sorted);
+}
+
+bool statistics_is_outlier(const statistics_t *statistics, double sample) {
+	return sample < statistics->low_fence || sample > statistics->high_fence;
+}
+
+static double quantile(const double *sorted, uint32_t count, double q) {
+	double rank = q * (count - 1);
+	uint32_t below = (uint32_t) rank;
+	if(below + 1 >= count) {
+		return sorted[count - 1];
+	}
+
+	return sorted[below] + (rank - below) * (sorted[below + 1] - sorted[below]);
+}
+
+static int compare_doubles(const void *a, const void *b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
@@ -0,0 +1,35 @@
+/*
+ * Statistics.h
+ * Author: Christian Würthner
+ * Description: Summary statistics of the run times measured by StopWatch.
+ */
+
+#ifndef STATISTICS_H
+#define STATISTICS_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Summary of a set of samples. Outliers are the samples outside of Tukey's fences, 1.5 times the
+   interquartile range below the first or above the third quartile. */
+typedef struct {
+	uint32_t count;
+	double min;
+	double max;
+	double mean;
+	double stddev;
+	double median;
+	double p95;
+	double p99;
+	double low_fence;
+	double high_fence;
+	uint32_t outlier_count;
+} statistics_t;
+
+/* Computes the statistics of count samples, the samples are not changed */
+void statistics_compute(const double *samples, uint32_t count, statistics_t *statistics);
+
+/* Returns true if the sample is outside of the fences of the statistics */
+bool statistics_is_outlier(const statistics_t *statistics, double sample);
+
+#endif
@@ -4,218 +4,631 @@
  * Description: Call all copy programs and stop their execution times
  */
 
-#define SAMPLE_FILE_NAME "StopWatchSample"
-#define SAMPLE_FILE_COPY_NAME "StopWatchSampleCopy"
-#define COPY_PROGRAMS {"cp", "./MyCopy", "./ForkCopy", "./PipeCopy"}
-#define SAMPLE_FILE_BLOCK_SIZE 1024 /* 1 KiB */
-#define SAMPLE_FILE_SIZE SAMPLE_FILE_BLOCK_SIZE * 1024 * 16 /* 16 MiB */
-#define EXECLP_ERROR 42
-#define _POSIX_C_SOURCE 199309L
-
-#include <stdio.h>
-#include <inttypes.h>
-#include <stdlib.h>
-#include <errno.h>
-#include <string.h>
-#include <time.h>
-#include <sys/time.h>
-#include <fcntl.h>
-#include <unistd.h>
-#include <sys/wait.h>
-#include <time.h>
-
-/* Struct for all necessary data for measuring the elapsed time with both methods */
-typedef struct {
- 	char* program_name;
- 	double start_times[3];
- 	double end_times[3];
- 	double elapsed_ms[3];
-} stopwatch_t;
-
-/* Creates a sample file with the size defined in SAMPLE_FILE_SIZE */
-void create_sample_file();
-
-/* Deletes the sample file and it's copy */
-void clean_up();
-
-/* Calls the copy program specified by copy_program_name */
-int call_copy(char* copy_program_name);
-
-/* Deletes the file defined by name */
-void delete_file(char* name);
-
-/* Sets the start fields in time to the current time */
-void start_stopwatch(stopwatch_t *time);
-
-/* Sets the stop fields in time to the current time and calculates the elapsed time */
-void stop_stopwatch(stopwatch_t *time);
-
-/* Sets the current times in the given double array */
-void set_times(double *times);
+#include "StopWatch.h"
 
-int main(int argc, char const *argv[]) {
- 	/* create a sample file to test the copy processes */
- 	create_sample_file();
+/* Parses the command line into options, returns false and prints an error if it is invalid */
+bool parse_options(int argc, char const *argv[], stopwatch_options_t *options);
+
+/* Calls the copy program specified by copy_program_name, its resources are stored in usage. The
+   perf counters are attached to it if counters isn't NULL. Directory trees are copied with -r. */
+int call_copy(char* copy_program_name, bool tree, struct rusage *usage, perf_counters_t *counters);
 
- 	/* Create necessary fields */
- 	char *programs[] = COPY_PROGRAMS;
- 	uint8_t program_count = sizeof(programs)/sizeof(char*);
- 	stopwatch_t *times = malloc(sizeof(stopwatch_t) * program_count);
- 	int status;
+/* Runs the program once and stores its times in sample if it isn't NULL. Returns the plain exit
+   status of the program. */
+int run_once(benchmark_t *benchmark, stopwatch_t *sample, stopwatch_options_t *options);
 
- 	/* Iterate over all processes to test */
- 	for(uint16_t i=0; i<program_count; i++) {
- 		/* Set program name */
- 		times[i].program_name = programs[i];
+/* Prints the result in the selected format */
+void print_table(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options);
+void print_csv(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options);
+void print_json(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options);
 
- 		/* Save start time */
- 		start_stopwatch(times + i);
+/* Status messages, they go to stderr if the result is printed as CSV or JSON */
+FILE *messages;
 
- 		/* Copy and wait */
- 		status = call_copy(programs[i]);
+/* Compares the latency of posix_spawn() and fork()/exec for growing sizes of our address space */
+int launch_benchmark();
 
-		/* Query the plain exit status */
-		status = WEXITSTATUS(status);
+/* Removes one entry of a directory tree, called by nftw() */
+static int delete_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw);
+
+/* Drops the pages of one file of a directory tree, called by nftw() */
+static int drop_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw);
+
+int main(int argc, char const *argv[]) {
+ 	/* Parse arguments and print manual */
+ 	stopwatch_options_t options;
+ 	if(!parse_options(argc, argv, &options)) {
+ 		return 3;
+ 	}
+ 	messages = options.format == FORMAT_TABLE && !options.sweep ? stdout : stderr;
+
+ 	/* Only measure how fast children are started */
+ 	if(options.launch_benchmark) {
+ 		return launch_benchmark();
+ 	}
+
+ 	/* Run the whole matrix of sizes instead of the sample file only */
+ 	if(options.sweep) {
+ 		return sweep_run(&options);
+ 	}
 
- 		/* Check success */
- 		if(status != 0) {
- 			printf("ERROR: Child process finished abnormally with status %d\n", status);
+ 	/* create a sample file to test the copy processes */
+ 	create_sample_file(SAMPLE_FILE_SIZE, options.dataset);
+
+ 	/* Create necessary fields, PipeCopy only copies single files */
+ 	char *file_programs[] = COPY_PROGRAMS;
+ 	char *tree_programs[] = TREE_COPY_PROGRAMS;
+ 	bool tree = options.dataset == DATASET_SMALL_FILES;
+ 	char **programs = tree ? tree_programs : file_programs;
+ 	uint8_t program_count = tree ? sizeof(tree_programs)/sizeof(char*) : sizeof(file_programs)/sizeof(char*);
+ 	benchmark_t *benchmarks = calloc(program_count, sizeof(benchmark_t));
+ 	for(uint8_t i=0; i<program_count; i++) {
+ 		benchmarks[i].program_name = programs[i];
+ 		benchmarks[i].wall_ms = malloc(sizeof(double) * options.runs);
+ 	}
 
- 			if(status == EXECLP_ERROR) {
- 				printf("HINT: execlp() failed. Please make sure that you call PipeCopy in the bin folder and all needed programs are also in the bin folder.\n");
+ 	/* Warm up the page cache and the programs, then run the programs in turns, so a slow phase
+ 	   of the machine doesn't hit one program only */
+ 	uint32_t total_runs = options.warmup_runs + options.runs;
+ 	for(uint32_t run=0; run<total_runs; run++) {
+ 		for(uint8_t i=0; i<program_count; i++) {
+ 			if(run == 0) {
+ 				fprintf(messages, "CALL: %s%s %s %s\n", programs[i], tree ? " -r" : "", SAMPLE_FILE_NAME, SAMPLE_FILE_COPY_NAME);
  			}
 
- 			/* cleanup the files */
- 			clean_up();
+ 			/* Copy and wait, warmup runs are not recorded */
+ 			stopwatch_t sample;
+ 			int status = run_once(benchmarks + i, run < options.warmup_runs ? NULL : &sample, &options);
 
- 			return 2;
- 		}
+ 			/* Check success */
+ 			if(status != 0) {
+ 				fprintf(messages, "ERROR: Child process finished abnormally with status %d\n", status);
+
+ 				if(status == EXECLP_ERROR) {
+ 					fprintf(messages, "HINT: execlp() failed. Please make sure that you call PipeCopy in the bin folder and all needed programs are also in the bin folder.\n");
+ 				}
+
+ 				/* cleanup the files */
+ 				clean_up();
 
- 		/* Calculated time elapsed */
- 		stop_stopwatch(times + i);
+ 				return 2;
+ 			}
+
+ 			/* Record the times */
+ 			if(run >= options.warmup_runs) {
+ 				benchmarks[i].wall_ms[run - options.warmup_runs] = sample.elapsed_ms;
+ 				add_usage(&benchmarks[i].resources, &sample.usage, options.runs);
+ 				if(options.counters) {
+ 					add_counters(&benchmarks[i].counters, &sample.counters, options.runs);
+ 				}
+ 			}
+ 		}
  	}
 
  	/* clean up all files created */
  	clean_up();
 
  	/* Print results */
- 	printf("RESULT:\n");
- 	printf("==================================================================================\n");
- 	printf("| %-14s | clock()\t | gettimeofday()\t | clock_gettime()\t |\n", "Program");
- 	printf("----------------------------------------------------------------------------------\n");
  	for(uint8_t i=0; i<program_count; i++) {
- 		printf("| %-14s | %.3fms\t | %.12fms\t | %.12fms\t |\n", 
- 			times[i].program_name, times[i].elapsed_ms[0], times[i].elapsed_ms[1], times[i].elapsed_ms[2]);
+ 		statistics_compute(benchmarks[i].wall_ms, options.runs, &benchmarks[i].statistics);
+ 	}
+ 	switch(options.format) {
+ 		case FORMAT_CSV: print_csv(benchmarks, program_count, &options); break;
+ 		case FORMAT_JSON: print_json(benchmarks, program_count, &options); break;
+ 		default: print_table(benchmarks, program_count, &options); break;
  	}
- 	printf("==================================================================================\n");
+
+ 	for(uint8_t i=0; i<program_count; i++) {
+ 		free(benchmarks[i].wall_ms);
+ 	}
+ 	free(benchmarks);
 
  	return 0;
  }
 
-void create_sample_file() {
-	/* Create sample file and catch error */
-	FILE *sample = fopen(SAMPLE_FILE_NAME, "w+");
-	if(sample == NULL) {
-		printf("ERROR: Unable to create sample file '%s'\n", SAMPLE_FILE_NAME);
-		exit(1);
+bool parse_options(int argc, char const *argv[], stopwatch_options_t *options) {
+	/* Set defaults */
+	memset(options, 0, sizeof(stopwatch_options_t));
+	options->warmup_runs = DEFAULT_WARMUP_RUNS;
+	options->runs = DEFAULT_RUNS;
+	options->format = FORMAT_TABLE;
+	options->cache = CACHE_BOTH;
+	options->dataset = DATASET_RANDOM;
+	parse_size_list(DEFAULT_SWEEP_SIZES, options->sizes, &options->size_count);
+	parse_size_list(DEFAULT_SWEEP_BLOCK_SIZES, options->block_sizes, &options->block_size_count);
+
+	/* Define long options */
+	static const struct option long_options[] = {
+		{"warmup", required_argument, NULL, 'w'},
+		{"runs", required_argument, NULL, 'r'},
+		{"format", required_argument, NULL, 'f'},
+		{"launch-benchmark", no_argument, NULL, 'l'},
+		{"counters", no_argument, NULL, 'C'},
+		{"sweep", no_argument, NULL, 's'},
+		{"sizes", required_argument, NULL, 'S'},
+		{"block-sizes", required_argument, NULL, 'b'},
+		{"cache", required_argument, NULL, 'c'},
+		{"data", required_argument, NULL, 'd'},
+		{NULL, 0, NULL, 0}
+	};
+
+	/* Parse options, errors are printed by us */
+	opterr = 0;
+	int option;
+	while((option = getopt_long(argc, (char * const *) argv, "", long_options, NULL)) != -1) {
+		switch(option) {
+			case 'w':
+				if(!parse_count(optarg, &options->warmup_runs) || options->warmup_runs > MAX_RUNS) {
+					printf("ERROR: Invalid warmup count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'r':
+				if(!parse_count(optarg, &options->runs) || options->runs == 0 || options->runs > MAX_RUNS) {
+					printf("ERROR: Invalid run count \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'f':
+				if(strcmp(optarg, "table") == 0) {
+					options->format = FORMAT_TABLE;
+				} else if(strcmp(optarg, "csv") == 0) {
+					options->format = FORMAT_CSV;
+				} else if(strcmp(optarg, "json") == 0) {
+					options->format = FORMAT_JSON;
+				} else {
+					printf("ERROR: Invalid format \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'l':
+				options->launch_benchmark = true;
+				break;
+
+			case 's':
+				options->sweep = true;
+				break;
+
+			case 'C':
+				options->counters = true;
+				break;
+
+			case 'S':
+				if(!parse_size_list(optarg, options->sizes, &options->size_count)) {
+					printf("ERROR: Invalid sizes \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'b':
+				if(!parse_size_list(optarg, options->block_sizes, &options->block_size_count)) {
+					printf("ERROR: Invalid block sizes \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'c':
+				if(strcmp(optarg, "warm") == 0) {
+					options->cache = CACHE_WARM;
+				} else if(strcmp(optarg, "cold") == 0) {
+					options->cache = CACHE_COLD;
+				} else if(strcmp(optarg, "both") == 0) {
+					options->cache = CACHE_BOTH;
+				} else {
+					printf("ERROR: Invalid cache state \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			case 'd':
+				if(!dataset_parse(optarg, &options->dataset)) {
+					printf("ERROR: Invalid data pattern \"%s\". %s\n", optarg, USAGE);
+					return false;
+				}
+				break;
+
+			default:
+				printf("ERROR: Invalid option. %s\n", USAGE);
+				return false;
+		}
 	}
 
-	/* Create a sample buffer filled with 42s */
-	uint8_t buffer[SAMPLE_FILE_BLOCK_SIZE] = {42};
+	if(optind != argc) {
+		printf("ERROR: Invalid arguments. %s\n", USAGE);
+		return false;
+	}
 
-	/* Fill sample file */
-	for(uint64_t i=0; i<SAMPLE_FILE_SIZE; i+=SAMPLE_FILE_BLOCK_SIZE) {
-		fwrite(buffer, 1, SAMPLE_FILE_BLOCK_SIZE, sample);
+	return true;
+}
+
+bool parse_count(const char *text, uint32_t *count) {
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul(text, &end, 10);
+	if(errno != 0 || end == text || *end != 0 || text[0] == '-' || value > UINT32_MAX) {
+		return false;
 	}
 
-	/* Close sample file */
-	fclose(sample);
+	*count = value;
+	return true;
+}
+
+bool parse_size_list(const char *text, uint64_t *sizes, uint32_t *count) {
+	uint32_t parsed = 0;
+	while(true) {
+		/* A number, optionally followed by a binary unit */
+		char *end;
+		errno = 0;
+		unsigned long long value = strtoull(text, &end, 10);
+		if(errno != 0 || end == text || text[0] == '-' || value == 0 || parsed == MAX_SWEEP_VALUES) {
+			return false;
+		}
+		const char *units = "KMG";
+		const char *unit = *end != 0 ? strchr(units, toupper(*end)) : NULL;
+		if(unit != NULL) {
+			for(const char *u=units; u<=unit; u++) {
+				if(value > UINT64_MAX / 1024) {
+					return false;
+				}
+				value *= 1024;
+			}
+			end++;
+		}
+		sizes[parsed++] = value;
+
+		/* The next one follows a comma */
+		if(*end == 0) {
+			break;
+		}
+		if(*end != ',') {
+			return false;
+		}
+		text = end + 1;
+	}
+
+	*count = parsed;
+	return true;
+}
+
+int run_once(benchmark_t *benchmark, stopwatch_t *sample, stopwatch_options_t *options) {
+	/* A tree would be copied into the copy of the last run, so it is removed outside of the time */
+	bool tree = options->dataset == DATASET_SMALL_FILES;
+	if(tree) {
+		delete_file(SAMPLE_FILE_COPY_NAME, false);
+	}
+
+	/* Save start time, the counters stay zero without --counters */
+	stopwatch_t time;
+	memset(&time, 0, sizeof(stopwatch_t));
+	start_stopwatch(&time);
+
+	/* Copy and wait */
+	int status = call_copy(benchmark->program_name, tree, &time.usage, options->counters ? &time.counters : NULL);
+
+	/* Calculated time elapsed */
+	stop_stopwatch(&time);
+	if(sample != NULL) {
+		*sample = time;
+	}
+
+	/* Query the plain exit status */
+	return WEXITSTATUS(status);
+}
+
+void print_table(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options) {
+	printf("RESULT: %" PRIu32 " runs after %" PRIu32 " warmup runs, wall times of clock_gettime(CLOCK_MONOTONIC)\n", options->runs, options->warmup_runs);
+	printf("==================================================================================================\n");
+	printf("| %-14s | %-11s | %-11s | %-11s | %-11s | %-11s | %-8s |\n",
+		"Program", "Median", "Mean", "Stddev", "p95", "p99", "Outliers");
+	printf("--------------------------------------------------------------------------------------------------\n");
+	for(uint8_t i=0; i<program_count; i++) {
+		statistics_t *statistics = &benchmarks[i].statistics;
+		printf("| %-14s | %9.3fms | %9.3fms | %9.3fms | %9.3fms | %9.3fms | %8" PRIu32 " |\n",
+			benchmarks[i].program_name, statistics->median, statistics->mean, statistics->stddev,
+			statistics->p95, statistics->p99, statistics->outlier_count);
+	}
+	printf("==================================================================================================\n");
+
+	/* Resources of the children from wait4(), they include the children they waited for */
+	printf("RESOURCES: mean per run of the program and its children (wait4)\n");
+	printf("=========================================================================================================================\n");
+	printf("| %-14s | %-9s | %-9s | %-10s | %-8s | %-8s | %-8s | %-9s | %-8s | %-9s |\n",
+		"Program", "User", "System", "Max RSS", "Major", "Minor", "Vol. CS", "Invol. CS", "Block in", "Block out");
+	printf("-------------------------------------------------------------------------------------------------------------------------\n");
+	for(uint8_t i=0; i<program_count; i++) {
+		resources_t *resources = &benchmarks[i].resources;
+		printf("| %-14s | %7.3fms | %7.3fms | %7.0fKiB | %8.1f | %8.1f | %8.1f | %9.1f | %8.1f | %9.1f |\n",
+			benchmarks[i].program_name, resources->user_ms, resources->sys_ms, resources->max_rss_kib, resources->major_faults,
+			resources->minor_faults, resources->voluntary_switches, resources->involuntary_switches, resources->block_in,
+			resources->block_out);
+	}
+	printf("=========================================================================================================================\n");
+
+	/* Counters of the program and all its children, n/a if the machine can't count them */
+	if(!options->counters) {
+		return;
+	}
+	printf("COUNTERS: mean per run of the program and its children (perf_event_open)\n");
+	printf("=====================================================================================================================================\n");
+	printf("| %-14s |", "Program");
+	for(uint8_t j=0; j<PERF_COUNTER_COUNT; j++) {
+		printf(" %14s |", perf_counter_name(j));
+	}
+	printf("\n-------------------------------------------------------------------------------------------------------------------------------------\n");
+	for(uint8_t i=0; i<program_count; i++) {
+		printf("| %-14s |", benchmarks[i].program_name);
+		for(uint8_t j=0; j<PERF_COUNTER_COUNT; j++) {
+			if(benchmarks[i].counters.values[j] < 0) {
+				printf(" %14s |", "n/a");
+			} else {
+				printf(" %14.*f |", j == PERF_TASK_CLOCK ? 3 : 0, benchmarks[i].counters.values[j]);
+			}
+		}
+		printf("\n");
+	}
+	printf("=====================================================================================================================================\n");
+}
+
+void print_csv(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options) {
+	printf("program,warmup_runs,runs,median_ms,mean_ms,stddev_ms,min_ms,max_ms,p95_ms,p99_ms,outliers,"
+		"user_ms,sys_ms,max_rss_kib,major_faults,minor_faults,voluntary_switches,involuntary_switches,block_in,block_out");
+	for(uint8_t j=0; options->counters && j<PERF_COUNTER_COUNT; j++) {
+		printf(",%s", perf_counter_name(j));
+	}
+	printf("\n");
+	for(uint8_t i=0; i<program_count; i++) {
+		statistics_t *statistics = &benchmarks[i].statistics;
+		resources_t *resources = &benchmarks[i].resources;
+		printf("%s,%" PRIu32 ",%" PRIu32 ",%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%" PRIu32 ",%.6f,%.6f,%.0f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f",
+			benchmarks[i].program_name, options->warmup_runs, options->runs, statistics->median, statistics->mean,
+			statistics->stddev, statistics->min, statistics->max, statistics->p95, statistics->p99, statistics->outlier_count,
+			resources->user_ms, resources->sys_ms, resources->max_rss_kib, resources->major_faults, resources->minor_faults,
+			resources->voluntary_switches, resources->involuntary_switches, resources->block_in, resources->block_out);
+
+		/* Missing counters are empty */
+		for(uint8_t j=0; options->counters && j<PERF_COUNTER_COUNT; j++) {
+			if(benchmarks[i].counters.values[j] < 0) {
+				printf(",");
+			} else {
+				printf(",%.3f", benchmarks[i].counters.values[j]);
+			}
+		}
+		printf("\n");
+	}
+}
+
+void print_json(benchmark_t *benchmarks, uint8_t program_count, stopwatch_options_t *options) {
+	printf("{\"warmup_runs\": %" PRIu32 ", \"runs\": %" PRIu32 ", \"sample_size\": %d, \"data\": \"%s\", \"programs\": [\n",
+		options->warmup_runs, options->runs, SAMPLE_FILE_SIZE, dataset_name(options->dataset));
+	for(uint8_t i=0; i<program_count; i++) {
+		statistics_t *statistics = &benchmarks[i].statistics;
+		resources_t *resources = &benchmarks[i].resources;
+		printf("  {\"program\": \"%s\", \"median_ms\": %.6f, \"mean_ms\": %.6f, \"stddev_ms\": %.6f, "
+			"\"min_ms\": %.6f, \"max_ms\": %.6f, \"p95_ms\": %.6f, \"p99_ms\": %.6f, \"outliers\": %" PRIu32 ",\n",
+			benchmarks[i].program_name, statistics->median, statistics->mean, statistics->stddev,
+			statistics->min, statistics->max, statistics->p95, statistics->p99, statistics->outlier_count);
+		printf("   \"resources\": {\"user_ms\": %.6f, \"sys_ms\": %.6f, \"max_rss_kib\": %.0f, \"major_faults\": %.2f, "
+			"\"minor_faults\": %.2f, \"voluntary_switches\": %.2f, \"involuntary_switches\": %.2f, \"block_in\": %.2f, "
+			"\"block_out\": %.2f},\n", resources->user_ms, resources->sys_ms, resources->max_rss_kib, resources->major_faults,
+			resources->minor_faults, resources->voluntary_switches, resources->involuntary_switches, resources->block_in,
+			resources->block_out);
+
+		/* Missing counters are null */
+		if(options->counters) {
+			printf("   \"counters\": {");
+			for(uint8_t j=0; j<PERF_COUNTER_COUNT; j++) {
+				printf("%s\"%s\": ", j > 0 ? ", " : "", perf_counter_name(j));
+				if(benchmarks[i].counters.values[j] < 0) {
+					printf("null");
+				} else {
+					printf("%.3f", benchmarks[i].counters.values[j]);
+				}
+			}
+			printf("},\n");
+		}
+
+		/* The samples in the order they were measured, outliers are flagged */
+		printf("   \"samples_ms\": [");
+		for(uint32_t j=0; j<options->runs; j++) {
+			printf("%s%.6f", j > 0 ? ", " : "", benchmarks[i].wall_ms[j]);
+		}
+		printf("],\n   \"outlier_runs\": [");
+		bool first = true;
+		for(uint32_t j=0; j<options->runs; j++) {
+			if(statistics_is_outlier(statistics, benchmarks[i].wall_ms[j])) {
+				printf("%s%" PRIu32, first ? "" : ", ", j);
+				first = false;
+			}
+		}
+		printf("]}%s\n", i + 1 < program_count ? "," : "");
+	}
+	printf("]}\n");
+}
+
+void create_sample_file(uint64_t size, dataset_pattern_t pattern) {
+	/* Leftovers of an aborted run would end up in a tree */
+	delete_file(SAMPLE_FILE_NAME, false);
+
+	/* Create sample with one thread per CPU and catch error */
+	double start = now_ms();
+	if(dataset_create(SAMPLE_FILE_NAME, size, pattern, 0) != 0) {
+		fprintf(messages, "ERROR: Unable to create sample file '%s' (%s)\n", SAMPLE_FILE_NAME, strerror(errno));
+		exit(1);
+	}
 
 	/* Print success */
-	printf("SUCCESS: Created sample file '%s' with a total size of %d bytes\n", SAMPLE_FILE_NAME, SAMPLE_FILE_SIZE);
+	double elapsed_ms = now_ms() - start;
+	fprintf(messages, "SUCCESS: Created sample file '%s' with a total size of %" PRIu64 " bytes of %s data in %.1fms (%.0f MiB/s)\n",
+		SAMPLE_FILE_NAME, size, dataset_name(pattern), elapsed_ms, elapsed_ms > 0 ? size / 1048576. / (elapsed_ms / 1000.) : 0);
 }
 
 void clean_up() {
 	/* Delete both files and print success */
-	delete_file(SAMPLE_FILE_NAME);
-	delete_file(SAMPLE_FILE_COPY_NAME);
-	printf("SUCCESS: Cleanup complete\n");
+	delete_file(SAMPLE_FILE_NAME, true);
+	delete_file(SAMPLE_FILE_COPY_NAME, true);
+	fprintf(messages, "SUCCESS: Cleanup complete\n");
 }
 
-void delete_file(char* name) {
-	/* Delete file and handle error */
-	if(remove(name) != 0) {
-		printf("ERROR: Unable to delete file '%s' (%s)\n", name, strerror(errno));
+void delete_file(char* name, bool report) {
+	/* Delete file, or the tree from the bottom up, and handle error */
+	struct stat name_stat;
+	int result = lstat(name, &name_stat) == 0 && S_ISDIR(name_stat.st_mode) ?
+		nftw(name, delete_entry, 16, FTW_DEPTH | FTW_PHYS) : remove(name);
+	if(result != 0) {
+		if(report) {
+			fprintf(messages, "ERROR: Unable to delete file '%s' (%s)\n", name, strerror(errno));
+		}
 		return;
 	}
 
 	/* Print success */
-	printf("SUCCESS: Deleted file '%s'\n", name);
+	if(report) {
+		fprintf(messages, "SUCCESS: Deleted file '%s'\n", name);
+	}
 }
 
-int call_copy(char* copy_program_name) {
-	printf("CALL: %s %s %s\n", copy_program_name, SAMPLE_FILE_NAME, SAMPLE_FILE_COPY_NAME);
-
-	/* Fork process */
-	pid_t pid = fork();
+static int delete_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+	return remove(path);
+}
 
-	/* Parent code */
-	if(pid > 0) {
-		/* Wait and return status */
-		int status;
-		wait(&status);
-		return status;
+void drop_cache(const char *name) {
+	/* Trees drop the pages of every file */
+	struct stat name_stat;
+	if(stat(name, &name_stat) == 0 && S_ISDIR(name_stat.st_mode)) {
+		nftw(name, drop_entry, 16, FTW_PHYS);
+		return;
 	}
 
-	/* Child code */
-	if(pid == 0) {
-		/* Redirect output to /dev/null/ */
-		int devNull = open("/dev/null", O_WRONLY);
-		dup2(devNull, 1);
-		dup2(devNull, 0);
-
-		/* exec */
-		execlp(copy_program_name, copy_program_name, SAMPLE_FILE_NAME, SAMPLE_FILE_COPY_NAME, NULL);
+	/* Only clean pages can be dropped, so write the dirty ones back first */
+	int fd = open(name, O_RDONLY);
+	if(fd < 0) {
+		return;
+	}
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
 
-		/* If this code is executed, execlp failed. */
-		exit(EXECLP_ERROR);
+static int drop_entry(const char *path, const struct stat *stat, int type, struct FTW *ftw) {
+	if(type == FTW_F) {
+		drop_cache(path);
 	}
+	return 0;
+}
 
-	/* Error handling */
-	if(pid < 0) {
-		printf("ERROR: Unable to fork process!\n");
+int call_copy(char* copy_program_name, bool tree, struct rusage *usage, perf_counters_t *counters) {
+	/* Start the program with its output redirected to /dev/null and wait for it, the counters need
+	   a child that waits for them before its exec. fork() is used, a posix_spawn() child runs on
+	   our address space until its exec and would report our maximum RSS as its own. */
+	char *file_argv[] = {copy_program_name, SAMPLE_FILE_NAME, SAMPLE_FILE_COPY_NAME, NULL};
+	char *tree_argv[] = {copy_program_name, "-r", SAMPLE_FILE_NAME, SAMPLE_FILE_COPY_NAME, NULL};
+	char **argv = tree ? tree_argv : file_argv;
+	launch_options_t options = {LAUNCH_FORK, true};
+	int status = counters != NULL ? perf_launch_and_wait(copy_program_name, argv, true, usage, counters) :
+		launch_and_wait(copy_program_name, argv, &options, usage);
+
+	/* Error handling, programs that can't be executed finish with EXECLP_ERROR instead */
+	if(status < 0) {
+		fprintf(messages, "ERROR: Unable to start or wait for process (%s)!\n", strerror(errno));
 		exit(2);
 	}
 
+	return status;
+}
+
+int launch_benchmark() {
+	size_t rss_sizes[] = LAUNCH_BENCHMARK_RSS_MIB;
+	launch_method_t methods[] = {LAUNCH_SPAWN, LAUNCH_FORK};
+	char *argv[] = {LAUNCH_BENCHMARK_PROGRAM, NULL};
+
+	printf("RESULT: %d launches of '%s' per cell, mean latency until the parent continues / until the child is reaped\n",
+		LAUNCH_BENCHMARK_RUNS, LAUNCH_BENCHMARK_PROGRAM);
+	printf("==================================================================\n");
+	printf("| %-10s | %-22s | %-22s |\n", "Parent RSS", launch_method_name(LAUNCH_SPAWN), launch_method_name(LAUNCH_FORK));
+	printf("------------------------------------------------------------------\n");
+
+	for(uint8_t i=0; i<sizeof(rss_sizes)/sizeof(size_t); i++) {
+		/* Grow the address space and touch every page, so the page tables have to be copied */
+		size_t size = rss_sizes[i] * 1024 * 1024;
+		uint8_t *ballast = size > 0 ? malloc(size) : NULL;
+		if(size > 0 && ballast == NULL) {
+			printf("| %6zu MiB | %-47s |\n", rss_sizes[i], "not enough memory");
+			continue;
+		}
+		if(ballast != NULL) {
+			memset(ballast, 1, size);
+		}
+
+		printf("| %6zu MiB |", rss_sizes[i]);
+		for(uint8_t j=0; j<sizeof(methods)/sizeof(launch_method_t); j++) {
+			launch_options_t options = {methods[j], true};
+			double launch_ms = 0, total_ms = 0;
+			for(uint16_t run=0; run<LAUNCH_BENCHMARK_RUNS; run++) {
+				/* Time until launch() returns and until the child is gone */
+				double start = now_ms();
+				pid_t pid = launch(LAUNCH_BENCHMARK_PROGRAM, argv, &options);
+				double launched = now_ms();
+				if(pid < 0) {
+					printf("\nERROR: Unable to start '%s' (%s)\n", LAUNCH_BENCHMARK_PROGRAM, strerror(errno));
+					free(ballast);
+					return 2;
+				}
+				waitpid(pid, NULL, 0);
+				launch_ms += launched - start;
+				total_ms += now_ms() - start;
+			}
+			printf(" %8.1fus / %8.1fus |", launch_ms * 1000. / LAUNCH_BENCHMARK_RUNS, total_ms * 1000. / LAUNCH_BENCHMARK_RUNS);
+		}
+		printf("\n");
+		fflush(stdout);
+
+		free(ballast);
+	}
+	printf("==================================================================\n");
+
 	return 0;
 }
 
+double now_ms() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
+}
+
 void start_stopwatch(stopwatch_t *time) {
-	/* Set start times */
-	set_times(time->start_times);
+	/* Set start time */
+	time->start_ms = now_ms();
 }
 
 void stop_stopwatch(stopwatch_t *time) {
-	/* Set end times */
-	set_times(time->end_times);
+	/* Set end time and calculate elapsed time */
+	time->end_ms = now_ms();
+	time->elapsed_ms = time->end_ms - time->start_ms;
+}
 
-	/* Calculate elapsed time */
-	for(uint8_t i=0; i<sizeof(time->elapsed_ms); i++) {
-		time->elapsed_ms[i] = time->end_times[i] - time->start_times[i];
+void add_usage(resources_t *resources, const struct rusage *usage, uint32_t runs) {
+	resources->user_ms += (usage->ru_utime.tv_sec * 1000. + usage->ru_utime.tv_usec / 1000.) / runs;
+	resources->sys_ms += (usage->ru_stime.tv_sec * 1000. + usage->ru_stime.tv_usec / 1000.) / runs;
+	if(usage->ru_maxrss > resources->max_rss_kib) {
+		resources->max_rss_kib = usage->ru_maxrss;
 	}
+	resources->major_faults += (double) usage->ru_majflt / runs;
+	resources->minor_faults += (double) usage->ru_minflt / runs;
+	resources->voluntary_switches += (double) usage->ru_nvcsw / runs;
+	resources->involuntary_switches += (double) usage->ru_nivcsw / runs;
+	resources->block_in += (double) usage->ru_inblock / runs;
+	resources->block_out += (double) usage->ru_oublock / runs;
 }
 
-void set_times(double *times) {
-	/* Set start time for clock() */
-	times[0] = (double) clock() / CLOCKS_PER_SEC / 1000.;
-
-	/* Set start time for gettimeofday() */
-	struct timeval tv;
-	gettimeofday(&tv, NULL); 
-	times[1] = tv.tv_sec * 1000. + tv.tv_usec / 1000.;
-
-	/* Set start time for clock_gettime() */
-	struct timespec ts;
-	clock_gettime(CLOCK_REALTIME, &ts);
-	times[2] = ts.tv_sec * 1000. + ts.tv_nsec / 1000000.;
-}
\ No newline at end of file
+void add_counters(perf_counters_t *means, const perf_counters_t *counters, uint32_t runs) {
+	for(uint8_t i=0; i<PERF_COUNTER_COUNT; i++) {
+		if(means->values[i] < 0 || counters->values[i] < 0) {
+			means->values[i] = -1;
+		} else {
+			means->values[i] += counters->values[i] / runs;
+		}
+	}
+}
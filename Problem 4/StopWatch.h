@@ -0,0 +1,150 @@
+/*
+ * StopWatch.h
+ * Author: Christian Würthner
+ * Description: Call all copy programs and stop their execution times
+ */
+
+#define _POSIX_C_SOURCE 200809L
+#define _XOPEN_SOURCE 700
+
+#define SAMPLE_FILE_NAME "StopWatchSample"
+#define SAMPLE_FILE_COPY_NAME "StopWatchSampleCopy"
+#define COPY_PROGRAMS {"cp", "./MyCopy", "./ForkCopy", "./PipeCopy"}
+#define TREE_COPY_PROGRAMS {"cp", "./MyCopy", "./ForkCopy"}
+#define SAMPLE_FILE_SIZE (16 * 1024 * 1024) /* 16 MiB */
+#define LAUNCH_BENCHMARK_PROGRAM "true"
+#define LAUNCH_BENCHMARK_RUNS 200
+#define LAUNCH_BENCHMARK_RSS_MIB {0, 64, 256, 1024}
+#define DEFAULT_WARMUP_RUNS 1
+#define DEFAULT_RUNS 10
+#define MAX_RUNS 100000
+#define DEFAULT_SWEEP_SIZES "4K,64K,1M,16M,256M,1G"
+#define DEFAULT_SWEEP_BLOCK_SIZES "4K,64K,1M"
+#define MAX_SWEEP_VALUES 32
+#define USAGE "Usage: ./StopWatch [--warmup=N] [--runs=N] [--format=table|csv|json] [--data=random|zeros|sparse|text|small-files] [--counters] [--sweep [--sizes=LIST] [--block-sizes=LIST] [--cache=warm|cold|both]] [--launch-benchmark]"
+
+#include "../Problem 2/Launcher.h"
+#include "Statistics.h"
+#include "PerfCounters.h"
+#include "Dataset.h"
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <ftw.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+/* Struct for all necessary data for measuring one run, the usage and the counters are the ones
+   of the child */
+typedef struct {
+ 	double start_ms;
+ 	double end_ms;
+ 	double elapsed_ms;
+ 	struct rusage usage;
+ 	perf_counters_t counters;
+} stopwatch_t;
+
+/* Resources used by a program and its children, the means of all runs. The maximum RSS is the
+   largest of all runs. */
+typedef struct {
+	double user_ms;
+	double sys_ms;
+	double max_rss_kib;
+	double major_faults;
+	double minor_faults;
+	double voluntary_switches;
+	double involuntary_switches;
+	double block_in;
+	double block_out;
+} resources_t;
+
+/* Formats of the result */
+typedef enum {
+	FORMAT_TABLE,
+	FORMAT_CSV,
+	FORMAT_JSON
+} output_format_t;
+
+/* States of the page cache a sweep measures */
+typedef enum {
+	CACHE_WARM = 1,
+	CACHE_COLD = 2,
+	CACHE_BOTH = 3
+} cache_state_t;
+
+/* Options parsed from the command line */
+typedef struct {
+	uint32_t warmup_runs;
+	uint32_t runs;
+	output_format_t format;
+	bool launch_benchmark;
+	bool counters;
+	bool sweep;
+	uint64_t sizes[MAX_SWEEP_VALUES];
+	uint32_t size_count;
+	uint64_t block_sizes[MAX_SWEEP_VALUES];
+	uint32_t block_size_count;
+	cache_state_t cache;
+	dataset_pattern_t dataset;
+} stopwatch_options_t;
+
+/* All measured runs of one program */
+typedef struct {
+	char *program_name;
+	double *wall_ms;
+	resources_t resources;
+	perf_counters_t counters;
+	statistics_t statistics;
+} benchmark_t;
+
+/* Status messages, they go to stderr if the result is printed as CSV or JSON or is a sweep, whose
+   table is read by gnuplot */
+extern FILE *messages;
+
+/* Parses a decimal number, returns false if text isn't one */
+bool parse_count(const char *text, uint32_t *count);
+
+/* Parses a comma separated list of sizes with an optional K, M or G suffix, returns false if text
+   isn't one */
+bool parse_size_list(const char *text, uint64_t *sizes, uint32_t *count);
+
+/* Creates the sample with the given size and pattern, a directory for DATASET_SMALL_FILES */
+void create_sample_file(uint64_t size, dataset_pattern_t pattern);
+
+/* Deletes the sample file and it's copy */
+void clean_up();
+
+/* Deletes the file or directory tree defined by name, errors are only printed if report is set */
+void delete_file(char* name, bool report);
+
+/* Writes the dirty pages of the file, or of all files in the directory tree, back and drops all of
+   their pages from the page cache */
+void drop_cache(const char *name);
+
+/* Sets the start fields in time to the current time */
+void start_stopwatch(stopwatch_t *time);
+
+/* Sets the stop fields in time to the current time and calculates the elapsed time */
+void stop_stopwatch(stopwatch_t *time);
+
+/* Adds one run to the resources */
+void add_usage(resources_t *resources, const struct rusage *usage, uint32_t runs);
+
+/* Adds one run to the means of the counters, counters missing in a run stay missing */
+void add_counters(perf_counters_t *means, const perf_counters_t *counters, uint32_t runs);
+
+/* Returns the time of the monotonic clock in ms */
+double now_ms();
+
+/* Runs the copy programs for every combination of the sizes, block sizes and cache states in the
+   options and prints one row per combination. Returns 0 or the exit status for main(). */
+int sweep_run(stopwatch_options_t *options);
@@ -0,0 +1,198 @@
+/*
+ * Sweep.c
+ * Author: Christian Würthner
+ * Description: Runs the copy programs for a matrix of file sizes, block sizes and cache states.
+ */
+
+#include "StopWatch.h"
+
+/* One way to call a copy program. The block size is appended to block_option, variants without
+   one are measured once per file size. dd takes its files as if= and of= operands. Only variants
+   that copy trees with -r are measured for small files. */
+typedef struct {
+	const char *label;
+	const char *program;
+	const char *option;
+	const char *block_option;
+	bool operands;
+	bool trees;
+} sweep_variant_t;
+
+/* All variants of the sweep */
+static const sweep_variant_t sweep_variants[] = {
+	{"cp", "cp", NULL, NULL, false, true},
+	{"MyCopy", "./MyCopy", NULL, NULL, false, true},
+	{"ForkCopy", "./ForkCopy", NULL, NULL, false, true},
+	{"PipeCopy", "./PipeCopy", NULL, NULL, false, false},
+	{"MyCopy-parallel", "./MyCopy", "--parallel", "--chunk=", false, false},
+	{"PipeCopy-pipe", "./PipeCopy", NULL, "--pipe-size=", false, false},
+	{"dd", "dd", "status=none", "bs=", true, false}
+};
+
+/* Measures one combination and prints its row. Returns 0 or the exit status for main(). */
+static int sweep_cell(const sweep_variant_t *variant, uint64_t size, uint64_t block_size, cache_state_t cache, stopwatch_options_t *options, bool *first_row);
+
+int sweep_run(stopwatch_options_t *options) {
+	/* Print the header, the table is a gnuplot data file */
+	if(options->format == FORMAT_CSV) {
+		printf("variant,size,block_size,cache,runs,median_ms,mean_ms,stddev_ms,p95_ms,outliers,mib_per_s,user_ms,sys_ms,major_faults,block_in\n");
+	} else if(options->format == FORMAT_JSON) {
+		printf("{\"warmup_runs\": %" PRIu32 ", \"runs\": %" PRIu32 ", \"data\": \"%s\", \"cells\": [\n", options->warmup_runs,
+			options->runs, dataset_name(options->dataset));
+	} else {
+		printf("# data: %s\n", dataset_name(options->dataset));
+		printf("# %-16s %12s %9s %-5s %11s %11s %11s %11s %8s %10s %10s %10s %8s %9s\n", "variant", "size", "block", "cache",
+			"median_ms", "mean_ms", "stddev_ms", "p95_ms", "outliers", "mib_per_s", "user_ms", "sys_ms", "major", "block_in");
+	}
+
+	bool first_row = true;
+	for(uint32_t i=0; i<options->size_count; i++) {
+		/* One sample file per size, it is copied by all variants */
+		create_sample_file(options->sizes[i], options->dataset);
+
+		for(uint8_t j=0; j<sizeof(sweep_variants)/sizeof(sweep_variant_t); j++) {
+			/* Variants without a block size are measured once with block size 0 */
+			const sweep_variant_t *variant = sweep_variants + j;
+			if(options->dataset == DATASET_SMALL_FILES && !variant->trees) {
+				continue;
+			}
+			uint32_t block_size_count = variant->block_option != NULL ? options->block_size_count : 1;
+			for(uint32_t k=0; k<block_size_count; k++) {
+				uint64_t block_size = variant->block_option != NULL ? options->block_sizes[k] : 0;
+
+				/* Warm before cold, the cold runs drop the pages anyway */
+				for(cache_state_t cache=CACHE_WARM; cache<=CACHE_COLD; cache++) {
+					if((options->cache & cache) == 0) {
+						continue;
+					}
+					int status = sweep_cell(variant, options->sizes[i], block_size, cache, options, &first_row);
+					if(status != 0) {
+						clean_up();
+						return status;
+					}
+				}
+			}
+		}
+
+		clean_up();
+	}
+
+	if(options->format == FORMAT_JSON) {
+		printf("]}\n");
+	}
+
+	return 0;
+}
+
+static int sweep_cell(const sweep_variant_t *variant, uint64_t size, uint64_t block_size, cache_state_t cache, stopwatch_options_t *options, bool *first_row) {
+	/* Build the command line */
+	char block_argument[64], src_argument[64], dest_argument[64];
+	char *argv[8];
+	uint8_t argc = 0;
+	bool tree = options->dataset == DATASET_SMALL_FILES;
+	argv[argc++] = (char*) variant->program;
+	if(tree) {
+		argv[argc++] = "-r";
+	}
+	if(variant->option != NULL) {
+		argv[argc++] = (char*) variant->option;
+	}
+	if(variant->block_option != NULL) {
+		snprintf(block_argument, sizeof(block_argument), "%s%" PRIu64, variant->block_option, block_size);
+		argv[argc++] = block_argument;
+	}
+	if(variant->operands) {
+		snprintf(src_argument, sizeof(src_argument), "if=%s", SAMPLE_FILE_NAME);
+		snprintf(dest_argument, sizeof(dest_argument), "of=%s", SAMPLE_FILE_COPY_NAME);
+		argv[argc++] = src_argument;
+		argv[argc++] = dest_argument;
+	} else {
+		argv[argc++] = SAMPLE_FILE_NAME;
+		argv[argc++] = SAMPLE_FILE_COPY_NAME;
+	}
+	argv[argc] = NULL;
+
+	fprintf(messages, "CALL:");
+	for(uint8_t i=0; i<argc; i++) {
+		fprintf(messages, " %s", argv[i]);
+	}
+	fprintf(messages, " (%s cache)\n", cache == CACHE_COLD ? "cold" : "warm");
+	fflush(messages);
+
+	double *wall_ms = malloc(sizeof(double) * options->runs);
+	if(wall_ms == NULL) {
+		fprintf(messages, "ERROR: Unable to allocate the samples!\n");
+		return 1;
+	}
+	resources_t resources;
+	memset(&resources, 0, sizeof(resources_t));
+
+	for(uint32_t run=0; run<options->warmup_runs + options->runs; run++) {
+		/* A tree would be copied into the copy of the last run */
+		if(tree) {
+			delete_file(SAMPLE_FILE_COPY_NAME, false);
+		}
+
+		/* Cold runs read the source from the disk and start without dirty pages of the copy */
+		if(cache == CACHE_COLD) {
+			drop_cache(SAMPLE_FILE_NAME);
+			drop_cache(SAMPLE_FILE_COPY_NAME);
+		}
+
+		/* Copy and wait, forked like in call_copy() for the maximum RSS of the child */
+		stopwatch_t time;
+		launch_options_t launch_options = {LAUNCH_FORK, true};
+		start_stopwatch(&time);
+		int status = launch_and_wait(argv[0], argv, &launch_options, &time.usage);
+		stop_stopwatch(&time);
+
+		/* Check success */
+		if(status < 0) {
+			fprintf(messages, "ERROR: Unable to start or wait for process (%s)\n", strerror(errno));
+			free(wall_ms);
+			return 2;
+		}
+		status = WEXITSTATUS(status);
+		if(status != 0) {
+			fprintf(messages, "ERROR: Child process finished abnormally with status %d\n", status);
+			if(status == EXECLP_ERROR) {
+				fprintf(messages, "HINT: execlp() failed. Please make sure that you call StopWatch in the bin folder and all needed programs are also in the bin folder.\n");
+			}
+			free(wall_ms);
+			return 2;
+		}
+
+		/* Warmup runs are not recorded */
+		if(run >= options->warmup_runs) {
+			wall_ms[run - options->warmup_runs] = time.elapsed_ms;
+			add_usage(&resources, &time.usage, options->runs);
+		}
+	}
+
+	/* Print the row, the throughput is the one of the median run */
+	statistics_t statistics;
+	statistics_compute(wall_ms, options->runs, &statistics);
+	free(wall_ms);
+	double mib_per_s = statistics.median > 0 ? size / 1048576. / (statistics.median / 1000.) : 0;
+	const char *cache_name = cache == CACHE_COLD ? "cold" : "warm";
+	if(options->format == FORMAT_CSV) {
+		printf("%s,%" PRIu64 ",%" PRIu64 ",%s,%" PRIu32 ",%.6f,%.6f,%.6f,%.6f,%" PRIu32 ",%.3f,%.6f,%.6f,%.2f,%.2f\n",
+			variant->label, size, block_size, cache_name, options->runs, statistics.median, statistics.mean, statistics.stddev,
+			statistics.p95, statistics.outlier_count, mib_per_s, resources.user_ms, resources.sys_ms, resources.major_faults,
+			resources.block_in);
+	} else if(options->format == FORMAT_JSON) {
+		printf("%s  {\"variant\": \"%s\", \"size\": %" PRIu64 ", \"block_size\": %" PRIu64 ", \"cache\": \"%s\", \"median_ms\": %.6f, "
+			"\"mean_ms\": %.6f, \"stddev_ms\": %.6f, \"p95_ms\": %.6f, \"outliers\": %" PRIu32 ", \"mib_per_s\": %.3f, "
+			"\"user_ms\": %.6f, \"sys_ms\": %.6f, \"major_faults\": %.2f, \"block_in\": %.2f}\n", *first_row ? "" : ",",
+			variant->label, size, block_size, cache_name, statistics.median, statistics.mean, statistics.stddev, statistics.p95,
+			statistics.outlier_count, mib_per_s, resources.user_ms, resources.sys_ms, resources.major_faults, resources.block_in);
+	} else {
+		printf("  %-16s %12" PRIu64 " %9" PRIu64 " %-5s %11.3f %11.3f %11.3f %11.3f %8" PRIu32 " %10.1f %10.3f %10.3f %8.1f %9.1f\n",
+			variant->label, size, block_size, cache_name, statistics.median, statistics.mean, statistics.stddev, statistics.p95,
+			statistics.outlier_count, mib_per_s, resources.user_ms, resources.sys_ms, resources.major_faults, resources.block_in);
+	}
+	fflush(stdout);
+	*first_row = false;
+
+	return 0;
+}